@@ -22,15 +22,6 @@
 extern "C" {
 #endif
 
-typedef struct ephem_ctx ephem_ctx;
-
-struct ephem_ctx
-{
-    size_t rows;
-    size_t cols;
-    double *PC;
-};
-
 enum {
     ephem_id_Sun = 0,
     ephem_id_Mercury = 1,
@@ -48,12 +39,217 @@ enum {
     ephem_id_Last = 13
 };
 
+enum {
+    ephem_layout_row = 0,
+    ephem_layout_body = 1
+};
+
+enum {
+    ephem_format_f64 = 0,
+    ephem_format_f32 = 1,
+    ephem_format_packed = 2
+};
+
+typedef struct ephem_body ephem_body;
+typedef struct ephem_pager ephem_pager;
+typedef struct ephem_chain ephem_chain;
+typedef struct ephem_spk ephem_spk;
+typedef struct ephem_tail ephem_tail;
+typedef struct ephem_cache ephem_cache;
+typedef struct ephem_pool ephem_pool;
+typedef struct ephem_ctx ephem_ctx;
+typedef struct ephem_save_opts ephem_save_opts;
+
+/*
+ * n is the stored coefficient count and err the position error bound in
+ * metres against the source ephemeris, zero for untruncated doubles.
+ * each record holds nsub sub-intervals of step days, offset elements apart.
+ */
+struct ephem_body
+{
+    size_t base;
+    size_t stride;
+    size_t n;
+    size_t step;
+    size_t nsub;
+    size_t offset;
+    double err;
+};
+
+struct ephem_ctx
+{
+    size_t rows;
+    size_t cols;
+    double *PC;
+    float *PF;
+    double *PT;
+    double jd_start;
+    double span;
+    size_t version;
+    size_t layout;
+    size_t format;
+    size_t tstride;
+    size_t tbytes;
+    int fixed;
+    unsigned absent;
+    ephem_body body[ephem_id_Last];
+    void *map;
+    size_t map_size;
+    ephem_pager *pager;
+    ephem_chain *chain;
+    ephem_spk *spk;
+    ephem_tail *tail;
+    ephem_cache *cache;
+    ephem_pool *pool;
+};
+
+/*
+ * tolerance in metres selects the fewest coefficients per body whose
+ * error bound, including float rounding, is within it. zero keeps all.
+ * packed files are compressed in blocks of block_rows records, zero
+ * selecting the default. legacy writes the original {rows, cols} file.
+ * records overlapping jd_start to jd_end are written, a zero bound
+ * leaving that side open. bodies outside mask are written absent and
+ * evaluate to NaN, a zero mask keeping all.
+ */
+struct ephem_save_opts
+{
+    int layout;
+    int format;
+    double tolerance;
+    size_t block_rows;
+    int legacy;
+    double jd_start;
+    double jd_end;
+    unsigned mask;
+};
+
+enum {
+    ephem_map_populate = (1 << 0),
+    ephem_map_hugepage = (1 << 1)
+};
+
+enum {
+    ephem_mask_all = (1u << ephem_id_Last) - 1
+};
+
+enum {
+    ephem_isa_scalar = 0,
+    ephem_isa_sse2 = 1,
+    ephem_isa_avx2 = 2,
+    ephem_isa_avx512 = 3
+};
+
+enum {
+    ephem_max_coeff = 32,
+    ephem_cursor_basis = 4
+};
+
+typedef struct ephem_track ephem_track;
+typedef struct ephem_basis ephem_basis;
+typedef struct ephem_cursor ephem_cursor;
+
+/*
+ * a track holds one body's current record in part, the file serving it
+ * for chained contexts. t0 is the record start and dates in [t1, t2) are
+ * served by the record.
+ */
+struct ephem_track
+{
+    ephem_ctx *part;
+    size_t row;
+    size_t sub;
+    double t0;
+    double t1;
+    double t2;
+    double jd0;
+    const double *C;
+    double buf[3 * ephem_max_coeff];
+};
+
+struct ephem_basis
+{
+    double jd;
+    size_t row;
+    size_t step;
+    size_t n;
+    double T[ephem_max_coeff];
+};
+
+struct ephem_cursor
+{
+    ephem_ctx *ctx;
+    size_t next;
+    ephem_track track[ephem_id_Last];
+    ephem_basis basis[ephem_cursor_basis];
+};
+
+/*
+ * a loaded context can be evaluated from several threads at once. packed
+ * and paged contexts read records through a page cache under a lock,
+ * copying coefficients out of the pages, so threads contend on the lock;
+ * de440_ephem_batch_parallel gives each worker pages of its own.
+ */
 void de440_create_ephem(ephem_ctx *ctx, const char *ephem_bin);
+void de440_map_ephem(ephem_ctx *ctx, const char *ephem_bin, int flags);
+void de440_page_ephem(ephem_ctx *ctx, const char *ephem_bin,
+    size_t block_rows, size_t budget);
+void de440_chain_ephem(ephem_ctx *ctx, const char **ephem_bin, size_t n,
+    int flags);
+void de440_spk_ephem(ephem_ctx *ctx, const char *spk_bsp, int flags);
+void de440_create_embedded(ephem_ctx *ctx, const void *image, size_t size);
+void de440_init_ephem(ephem_ctx *ctx, size_t rows, size_t cols, double *PC);
+void de440_jpl_layout(ephem_ctx *ctx, const char *jpl_header);
+void de440_save_ephem(ephem_ctx *ctx, const char *ephem_bin,
+    const ephem_save_opts *opts);
 void de440_destroy_ephem(ephem_ctx *ctx);
+/*
+ * records are taken as [start, end), so a date on the boundary between
+ * two records finds the later one, where the original lookup found the
+ * earlier. the end of the last record still finds that record.
+ */
 size_t de440_find_row(ephem_ctx *ctx, double jd);
 void de440_ephem_obj(ephem_ctx *ctx, double jd, size_t row, size_t oid,
     double *obj);
+/*
+ * tolerant evaluation keeps, in each record, the fewest coefficients whose
+ * error bound is within tol metres and returns the bound. the bounds are
+ * built on first use, from any thread, or ahead by de440_tail_init.
+ * nutations and librations, which come out in milliradians, always keep
+ * all their coefficients.
+ */
+double de440_ephem_obj_tol(ephem_ctx *ctx, double jd, size_t row,
+    size_t oid, double tol, double *obj);
+void de440_ephem_state(ephem_ctx *ctx, double jd, size_t oid,
+    double *pos, double *vel, double *acc);
+void de440_ephem_batch(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double *xyz_out);
+void de440_ephem_batch_strided(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double *x, double *y, double *z, size_t stride);
+double de440_ephem_batch_tol(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double tol, double *xyz_out);
+double de440_ephem_batch_f32(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double tol, double *xyz_out);
+void de440_ephem_batch_parallel(ephem_ctx *ctx, size_t oid,
+    const double *jd, size_t n, double *xyz_out, size_t nthreads);
+void de440_ephem_query(ephem_ctx *ctx, const double *jd, const size_t *oid,
+    size_t n, double *xyz_out);
+void de440_tail_init(ephem_ctx *ctx);
+/*
+ * caches results of de440_ephem_obj and de440_ephem_state in a lock free
+ * table of entries, rounded up to a power of two. it can be enabled on
+ * any context before threads share it; misses evaluate as uncached calls
+ * do, through the page cache lock on packed and paged contexts.
+ */
+void de440_cache_init(ephem_ctx *ctx, size_t entries);
+void de440_cache_stats(ephem_ctx *ctx, size_t *hits, size_t *misses);
+void de440_ephem_all(ephem_ctx *ctx, double jd, unsigned mask,
+    double out[][3]);
+void de440_cursor_init(ephem_cursor *cur, ephem_ctx *ctx);
+void de440_cursor_obj(ephem_cursor *cur, double jd, size_t oid, double *obj);
 const char* de440_object_name(size_t oid);
+int de440_set_isa(int isa);
+int de440_get_isa(void);
 
 #ifdef __cplusplus
 }
@@ -1,5 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include "matio.h"
 #include "ephembra.h"
@@ -8,67 +12,452 @@
 #define ephem_error(fmt, ...) \
     fprintf(stderr, fmt "\n" VA_ARGS(__VA_ARGS__)); exit(1);
 
-void convert(const char *ephem_mat, const char *ephem_bin)
+/*
+ * the matrix is stored column-major. it is read in slabs of whole records
+ * with Mat_VarReadData, each slab is transposed in tiles by a pool of
+ * threads, each taking a band of records, and written out as legacy
+ * row-major records before the next slab is read.
+ */
+#define CONVERT_TILE 32
+#define CONVERT_SLAB 1024
+#define CONVERT_THREADS 64
+
+typedef struct convert_band convert_band;
+
+struct convert_band
+{
+    const double *src;
+    double *dst;
+    size_t rows;
+    size_t cols;
+    size_t r0;
+    size_t r1;
+    pthread_t thread;
+};
+
+static void* transpose(void *arg)
+{
+    convert_band *b = arg;
+
+    for (size_t i0 = b->r0; i0 < b->r1; i0 += CONVERT_TILE) {
+        size_t i1 = i0 + CONVERT_TILE < b->r1 ? i0 + CONVERT_TILE : b->r1;
+        for (size_t j0 = 0; j0 < b->cols; j0 += CONVERT_TILE) {
+            size_t j1 = j0 + CONVERT_TILE < b->cols ?
+                j0 + CONVERT_TILE : b->cols;
+            for (size_t j = j0; j < j1; j++) {
+                for (size_t i = i0; i < i1; i++) {
+                    b->dst[i * b->cols + j] = b->src[j * b->rows + i];
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+void convert(const char *ephem_mat, const char *name, const char *ephem_bin,
+    size_t slab, size_t nthreads)
 {
     mat_t *f;
     matvar_t *v;
-    size_t rows, cols, dsize, nbytes;
-    double *src, *buf;
-    FILE *out;
+    FILE *o;
+    convert_band band[CONVERT_THREADS];
+    size_t rows, cols, dim[2], ssize;
+    double *src, *dst;
 
     f = Mat_Open(ephem_mat, MAT_ACC_RDONLY);
-    v = Mat_VarRead(f, "DE440Coeff");
-    if (!v || !v->data) {
-        ephem_error("mat_open: failed to read: %s", ephem_mat);
+    v = f ? Mat_VarReadInfo(f, name) : NULL;
+    if (!v || v->rank != 2) {
+        ephem_error("mat_open: failed to read %s: %s", name, ephem_mat);
     }
 
     rows = v->dims[0];
     cols = v->dims[1];
-    dsize = rows * cols * sizeof(double);
-    src = v->data;
-    buf = malloc(dsize);
+    slab = slab < rows ? slab : rows;
+    ssize = slab * cols * sizeof(double);
+    src = malloc(ssize);
+    dst = malloc(ssize);
+    if (!src || !dst) {
+        ephem_error("malloc: failed to allocate %zu bytes", 2 * ssize);
+    }
+
+    o = fopen(ephem_bin, "w");
+    if (!o) {
+        ephem_error("fopen: failed: %s", ephem_bin);
+    }
+    dim[0] = rows;
+    dim[1] = cols;
+    if (fwrite(dim, sizeof(dim), 1, o) != 1) {
+        ephem_error("fwrite: failed: %s", ephem_bin);
+    }
+
+    for (size_t r0 = 0; r0 < rows; r0 += slab) {
+        size_t m = slab < rows - r0 ? slab : rows - r0;
+        size_t per = (m / nthreads + CONVERT_TILE) &
+            ~(size_t)(CONVERT_TILE - 1);
+        int start[2] = { (int)r0, 0 }, stride[2] = { 1, 1 };
+        int edge[2] = { (int)m, (int)cols };
+
+        if (Mat_VarReadData(f, v, src, start, stride, edge) != 0) {
+            ephem_error("mat_read: failed at record %zu: %s", r0, ephem_mat);
+        }
+        for (size_t t = 0; t < nthreads; t++) {
+            convert_band *b = &band[t];
+            b->src = src;
+            b->dst = dst;
+            b->rows = m;
+            b->cols = cols;
+            b->r0 = t * per < m ? t * per : m;
+            b->r1 = (t + 1) * per < m ? (t + 1) * per : m;
+            if (t > 0 && pthread_create(&b->thread, NULL, transpose, b)) {
+                ephem_error("pthread_create: failed: %zu", t);
+            }
+        }
+        transpose(&band[0]);
+        for (size_t t = 1; t < nthreads; t++) {
+            pthread_join(band[t].thread, NULL);
+        }
+        if (fwrite(dst, sizeof(double), m * cols, o) != m * cols) {
+            ephem_error("fwrite: failed: %s", ephem_bin);
+        }
+    }
+
+    if (fclose(o) != 0) {
+        ephem_error("fclose: failed: %s", ephem_bin);
+    }
+    free(src);
+    free(dst);
+    Mat_VarFree(v);
+    Mat_Close(f);
+}
+
+/*
+ * JPL ASCII files hold records of a "number count" line followed by the
+ * coefficients three to a line in Fortran D notation, the last line
+ * padded. files are ordered by the start of their first record, parsed
+ * a wave at a time by a pool of threads and written in order, skipping
+ * records that repeat the end of the previous file. C has no from_chars
+ * so tokens are scanned by hand and converted by strtod, which rounds
+ * correctly.
+ */
+typedef struct ascii_file ascii_file;
+
+struct ascii_file
+{
+    const char *path;
+    double start;
+    double *rec;
+    size_t rows;
+    size_t cols;
+    pthread_t thread;
+};
+
+static int ascii_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static double ascii_number(const char **pp, const char *path)
+{
+    const char *p = *pp;
+    char tok[64], *e;
+    size_t n = 0;
+    double v;
+
+    while (ascii_space(*p)) {
+        p++;
+    }
+    while (*p && !ascii_space(*p) && n < sizeof(tok) - 1) {
+        tok[n++] = *p == 'D' || *p == 'd' ? 'E' : *p;
+        p++;
+    }
+    tok[n] = 0;
+    v = strtod(tok, &e);
+    if (n == 0 || *e) {
+        ephem_error("ascii: invalid number '%s': %s", tok, path);
+    }
+    *pp = p;
+    return v;
+}
+
+static char* ascii_read(const char *path, size_t limit)
+{
+    FILE *f = fopen(path, "r");
+    size_t size = limit, nbytes;
+    char *buf;
+
+    if (!f) {
+        ephem_error("fopen: failed: %s", path);
+    }
+    if (!size) {
+        fseek(f, 0, SEEK_END);
+        size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+    }
+    buf = malloc(size + 1);
     if (!buf) {
-        ephem_error("malloc: failed to allocate %zu bytes", dsize);
+        ephem_error("malloc: failed to allocate %zu bytes", size + 1);
     }
+    nbytes = fread(buf, 1, size, f);
+    buf[nbytes] = 0;
+    fclose(f);
+    return buf;
+}
+
+static void* ascii_parse(void *arg)
+{
+    ascii_file *a = arg;
+    char *buf = ascii_read(a->path, 0);
+    const char *p = buf;
+    size_t cap = 0;
 
-    for (size_t i = 0; i < rows; i++) {
-        for (size_t j = 0; j < cols; j++) {
-            double *r = src + j * rows + i;
-            double *w = buf + i * cols + j;
-            *w = *r;
+    a->rows = 0;
+    a->rec = NULL;
+    for (;;) {
+        size_t cols, pad;
+        char *e;
+        while (ascii_space(*p)) {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        strtoul(p, &e, 10);
+        cols = strtoul(e, &e, 10);
+        if (cols < 3 || (a->cols && cols != a->cols)) {
+            ephem_error("ascii: invalid record length %zu: %s", cols, a->path);
+        }
+        a->cols = cols;
+        p = e;
+        if (a->rows == cap) {
+            cap = cap ? cap * 2 : 256;
+            a->rec = realloc(a->rec, cap * cols * sizeof(double));
+            if (!a->rec) {
+                ephem_error("realloc: failed to allocate %zu bytes",
+                    cap * cols * sizeof(double));
+            }
+        }
+        for (size_t k = 0; k < cols; k++) {
+            a->rec[a->rows * cols + k] = ascii_number(&p, a->path);
+        }
+        for (pad = (3 - cols % 3) % 3; pad > 0; pad--) {
+            ascii_number(&p, a->path);
         }
+        a->rows++;
+    }
+    free(buf);
+    return NULL;
+}
+
+static double ascii_start(const char *path)
+{
+    char *buf = ascii_read(path, 4096), *e;
+    const char *p;
+    double start;
+
+    strtoul(buf, &e, 10);
+    strtoul(e, &e, 10);
+    p = e;
+    start = ascii_number(&p, path);
+    free(buf);
+    return start;
+}
+
+static int ascii_cmp(const void *x, const void *y)
+{
+    const ascii_file *a = x, *b = y;
+    return (a->start > b->start) - (a->start < b->start);
+}
+
+void convert_ascii(const char **path, size_t n, const char *ephem_bin,
+    size_t nthreads)
+{
+    ascii_file *a = calloc(n, sizeof(ascii_file));
+    size_t dim[2] = { 0, 0 };
+    double end = -INFINITY;
+    FILE *o;
+
+    if (!a) {
+        ephem_error("calloc: failed to allocate %zu bytes",
+            n * sizeof(ascii_file));
+    }
+    for (size_t k = 0; k < n; k++) {
+        a[k].path = path[k];
+        a[k].start = ascii_start(path[k]);
     }
+    qsort(a, n, sizeof(ascii_file), ascii_cmp);
 
-    out = fopen(ephem_bin, "w");
-    if (!out) {
+    o = fopen(ephem_bin, "w");
+    if (!o) {
         ephem_error("fopen: failed: %s", ephem_bin);
     }
-    nbytes = fwrite(&rows, 1, sizeof(size_t), out);
-    if (nbytes != sizeof(size_t)) {
-        ephem_error("fwrite: invalid size: %zu != %zu", nbytes, sizeof(size_t));
+    if (fwrite(dim, sizeof(dim), 1, o) != 1) {
+        ephem_error("fwrite: failed: %s", ephem_bin);
     }
-    nbytes = fwrite(&cols, 1, sizeof(size_t), out);
-    if (nbytes != sizeof(size_t)) {
-        ephem_error("fwrite: invalid size: %zu != %zu", nbytes, sizeof(size_t));
+
+    for (size_t w = 0; w < n; w += nthreads) {
+        size_t m = nthreads < n - w ? nthreads : n - w;
+        for (size_t t = 1; t < m; t++) {
+            if (pthread_create(&a[w + t].thread, NULL, ascii_parse,
+                    &a[w + t])) {
+                ephem_error("pthread_create: failed: %zu", t);
+            }
+        }
+        ascii_parse(&a[w]);
+        for (size_t t = 1; t < m; t++) {
+            pthread_join(a[w + t].thread, NULL);
+        }
+        for (size_t k = w; k < w + m; k++) {
+            if (dim[1] && a[k].cols != dim[1]) {
+                ephem_error("ascii: record length %zu != %zu: %s",
+                    a[k].cols, dim[1], a[k].path);
+            }
+            dim[1] = a[k].cols;
+            for (size_t r = 0; r < a[k].rows; r++) {
+                const double *rec = a[k].rec + r * dim[1];
+                if (rec[0] < end) {
+                    continue;
+                }
+                if (fwrite(rec, sizeof(double), dim[1], o) != dim[1]) {
+                    ephem_error("fwrite: failed: %s", ephem_bin);
+                }
+                end = rec[1];
+                dim[0]++;
+            }
+            free(a[k].rec);
+        }
     }
-    nbytes = fwrite((char*)buf, 1, dsize, out);
-    if (nbytes != dsize) {
-        ephem_error("fwrite: invalid size: %zu != %zu", nbytes, dsize);
+
+    if (fseek(o, 0, SEEK_SET) != 0 || fwrite(dim, sizeof(dim), 1, o) != 1 ||
+            fclose(o) != 0) {
+        ephem_error("fclose: failed: %s", ephem_bin);
     }
-    fclose(out);
+    free(a);
+}
 
-    free(buf);
+static int has_suffix(const char *s, const char *suffix)
+{
+    size_t l = strlen(s), m = strlen(suffix);
+    return l >= m && strcmp(s + l - m, suffix) == 0;
+}
 
-    Mat_VarFree(v);
-    Mat_Close(f);
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-b|-l] [-f f64|f32|packed] [-t metres] "
+        "[-H header.4xx] [-n name] [-j threads] [-s records] [-v]\n"
+        "    [DE440Coeff.mat|.bin|de440.bsp|ascp*.440 ...] [DE440Coeff.bin]\n"
+        "  -b  write body-major layout (coefficients contiguous per body)\n"
+        "  -l  write the legacy headerless layout\n"
+        "  -f  coefficient format (default f64), packed is lossless\n"
+        "      compressed row-major f64\n"
+        "  -t  truncate coefficients to this position error in metres\n"
+        "  -H  take the record layout from a JPL ASCII header, for\n"
+        "      DE-series ephemerides other than DE440\n"
+        "  -n  matrix variable name (default DE440Coeff)\n"
+        "  -j  threads for the .mat transpose and for parsing JPL ASCII\n"
+        "      files, one file per thread (default online cpus)\n"
+        "  -s  records read per .mat slab (default 1024)\n"
+        "  -v  print the coefficient count and error bound of each body\n",
+        prog);
+    exit(1);
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 3) {
-        fprintf(stderr, "usage: %s [DE440Coeff.mat] [DE440Coeff.bin]\n", argv[0]);
-        exit(1);
+    ephem_ctx ctx;
+    ephem_save_opts opts = {
+        ephem_layout_row, ephem_format_f64, 0, 0, 0, 0, 0, 0
+    };
+    const char *header = NULL, *name = "DE440Coeff", *in, *out;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t slab = CONVERT_SLAB, nthreads = ncpu > 0 ? ncpu : 1;
+    char tmp[4096];
+    int i = 1, ascii, verbose = 0;
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-b") == 0) {
+            opts.layout = ephem_layout_body;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            opts.legacy = 1;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "f64") == 0) {
+                opts.format = ephem_format_f64;
+            } else if (strcmp(argv[i], "f32") == 0) {
+                opts.format = ephem_format_f32;
+            } else if (strcmp(argv[i], "packed") == 0) {
+                opts.format = ephem_format_packed;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            opts.tolerance = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-H") == 0 && i + 1 < argc) {
+            header = argv[++i];
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            name = argv[++i];
+        } else if (strcmp(argv[i], "-v") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nthreads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            slab = strtoul(argv[++i], NULL, 10);
+            slab = slab ? slab : CONVERT_SLAB;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - i < 2) {
+        usage(argv[0]);
+    }
+    nthreads = nthreads < 1 ? 1 :
+        nthreads > CONVERT_THREADS ? CONVERT_THREADS : nthreads;
+    in = argv[i];
+    out = argv[argc - 1];
+    ascii = argc - i > 2 || !(has_suffix(in, ".mat") ||
+        has_suffix(in, ".bin") || has_suffix(in, ".bsp"));
+
+    /*
+     * .mat and ASCII sources stream to a legacy file, the output itself
+     * when that is what was asked for. sources are mapped, not loaded.
+     */
+    tmp[0] = 0;
+    if (ascii || has_suffix(in, ".mat")) {
+        const char *legacy = out;
+        if (!opts.legacy || header) {
+            snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+            legacy = tmp;
+        }
+        if (ascii) {
+            convert_ascii((const char**)argv + i, argc - i - 1, legacy,
+                nthreads);
+        } else {
+            convert(in, name, legacy, slab, nthreads);
+        }
+        in = tmp[0] ? tmp : NULL;
+    }
+    if (in) {
+        if (has_suffix(in, ".bsp")) {
+            de440_spk_ephem(&ctx, in, 0);
+        } else {
+            de440_map_ephem(&ctx, in, 0);
+        }
+        if (header) {
+            de440_jpl_layout(&ctx, header);
+        }
+        de440_save_ephem(&ctx, out, &opts);
+        de440_destroy_ephem(&ctx);
+    }
+    if (tmp[0]) {
+        unlink(tmp);
+    }
+
+    if (verbose) {
+        de440_map_ephem(&ctx, out, 0);
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            printf("%-12s n=%-2zu err=%.3g m\n", de440_object_name(oid),
+                ctx.body[oid].n, ctx.body[oid].err);
+        }
+        de440_destroy_ephem(&ctx);
     }
-    convert(argv[1], argv[2]);
     return 0;
 }
@@ -3,7 +3,11 @@
 
 #include "ephembra.h"
 
+#ifdef EPHEMBRA_EMBEDDED
+#include "ephembra_embedded.h"
+#else
 static const char* ephem_bin = "build/data/DE440Coeff.bin";
+#endif
 
 
 static void de440_print_planet(const char *name, double *r)
@@ -13,14 +17,14 @@ static void de440_print_planet(const char *name, double *r)
 
 void de440_print_ephemeris(ephem_ctx *ctx, double jd)
 {
-    size_t row = de440_find_row(ctx, jd);
+    double obj[ephem_id_Last][3];
+
+    de440_ephem_all(ctx, jd, ephem_mask_all, obj);
 
     printf("%20s: %10.2lf\n", "MJD", jd);
 
     for (size_t oid = 0; oid < ephem_id_Last; oid++) {
-        double obj[3];
-        de440_ephem_obj(ctx, jd, row, oid, obj);
-        de440_print_planet(de440_object_name(oid), obj);
+        de440_print_planet(de440_object_name(oid), obj[oid]);
     }
 }
 
@@ -28,7 +32,11 @@ void demo(double jd)
 {
     ephem_ctx ctx;
 
-    de440_create_ephem(&ctx, ephem_bin);
+#ifdef EPHEMBRA_EMBEDDED
+    de440_create_embedded(&ctx, ephembra_embedded, sizeof(ephembra_embedded));
+#else
+    de440_map_ephem(&ctx, ephem_bin, 0);
+#endif
     de440_print_ephemeris(&ctx, jd);
     de440_destroy_ephem(&ctx);
 }
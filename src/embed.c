@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "ephembra.h"
+
+#define VA_ARGS(...) , ##__VA_ARGS__
+#define ephem_error(fmt, ...) \
+    fprintf(stderr, fmt "\n" VA_ARGS(__VA_ARGS__)); exit(1);
+
+/*
+ * embed writes a date range and body subset of an ephemeris as a C header
+ * holding the file image in a const, 64-byte aligned array of words, for
+ * de440_create_embedded. the image is written by de440_save_ephem so it
+ * is an ordinary file with the usual layout table and record bounds.
+ */
+
+static int has_suffix(const char *s, const char *suffix)
+{
+    size_t l = strlen(s), m = strlen(suffix);
+    return l >= m && strcmp(s + l - m, suffix) == 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s jd] [-e jd] [-m mask] "
+        "[-f f64|f32|packed] [-t metres] [-n name]\n"
+        "    [DE440Coeff.bin|de440.bsp] [ephembra_embedded.h]\n"
+        "  -s  first julian date to keep (default the start of the file)\n"
+        "  -e  last julian date to keep (default the end of the file)\n"
+        "  -m  mask of object ids to keep (default all)\n"
+        "  -f  coefficient format (default f64)\n"
+        "  -t  truncate coefficients to this position error in metres\n"
+        "  -n  name of the array (default ephembra_embedded)\n",
+        prog);
+    exit(1);
+}
+
+static void* read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "r");
+    uint64_t *buf;
+    long len;
+
+    if (!f) {
+        ephem_error("fopen: failed: %s", path);
+    }
+    if (fseek(f, 0, SEEK_END) != 0 || (len = ftell(f)) < 0 ||
+            fseek(f, 0, SEEK_SET) != 0) {
+        ephem_error("fseek: failed: %s", path);
+    }
+    buf = calloc((len + 7) / 8 + 1, sizeof(uint64_t));
+    if (!buf) {
+        ephem_error("calloc: failed to allocate %ld bytes", len);
+    }
+    if (fread(buf, 1, len, f) != (size_t)len) {
+        ephem_error("fread: failed: %s", path);
+    }
+    fclose(f);
+    *size = len;
+    return buf;
+}
+
+static void write_header(const char *path, const char *name,
+    const uint64_t *w, size_t size, const char *in,
+    const ephem_save_opts *opts)
+{
+    FILE *f = fopen(path, "w");
+    size_t nw = (size + 7) / 8;
+
+    if (!f) {
+        ephem_error("fopen: failed: %s", path);
+    }
+    fprintf(f, "/* generated by embed from %s: jd %.1f to %.1f, "
+        "mask 0x%x, %zu bytes */\n\n", in, opts->jd_start, opts->jd_end,
+        opts->mask ? opts->mask : (unsigned)ephem_mask_all, size);
+    fprintf(f, "#pragma once\n\n#include <stdint.h>\n\n");
+    fprintf(f, "static const uint64_t %s[%zu] "
+        "__attribute__((aligned(64))) = {\n", name, nw);
+    for (size_t i = 0; i < nw; i++) {
+        fprintf(f, "%s0x%016llx,%s", i % 4 == 0 ? "    " : " ",
+            (unsigned long long)w[i], i % 4 == 3 || i + 1 == nw ? "\n" : "");
+    }
+    fprintf(f, "};\n");
+    if (fclose(f) != 0) {
+        ephem_error("fclose: failed: %s", path);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ephem_ctx ctx;
+    ephem_save_opts opts = {
+        ephem_layout_row, ephem_format_f64, 0, 0, 0, 0, 0, 0
+    };
+    const char *name = "ephembra_embedded", *in, *out;
+    char tmp[4096];
+    size_t size;
+    void *image;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            opts.jd_start = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            opts.jd_end = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            opts.mask = strtoul(argv[++i], NULL, 0) & ephem_mask_all;
+            if (!opts.mask) {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "f64") == 0) {
+                opts.format = ephem_format_f64;
+            } else if (strcmp(argv[i], "f32") == 0) {
+                opts.format = ephem_format_f32;
+            } else if (strcmp(argv[i], "packed") == 0) {
+                opts.format = ephem_format_packed;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            opts.tolerance = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            name = argv[++i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - i != 2) {
+        usage(argv[0]);
+    }
+    in = argv[i];
+    out = argv[i + 1];
+
+    if (has_suffix(in, ".bsp")) {
+        de440_spk_ephem(&ctx, in, 0);
+    } else {
+        de440_map_ephem(&ctx, in, 0);
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    de440_save_ephem(&ctx, tmp, &opts);
+    de440_destroy_ephem(&ctx);
+
+    image = read_file(tmp, &size);
+    unlink(tmp);
+    write_header(out, name, image, size, in, &opts);
+
+    de440_create_embedded(&ctx, image, size);
+    printf("%zu records from %.1f, %zu bytes\n", ctx.rows, ctx.jd_start,
+        size);
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        if (ctx.absent & (1u << oid)) {
+            printf("%-12s absent\n", de440_object_name(oid));
+        } else {
+            printf("%-12s n=%-2zu err=%.3g m\n", de440_object_name(oid),
+                ctx.body[oid].n, ctx.body[oid].err);
+        }
+    }
+    de440_destroy_ephem(&ctx);
+    free(image);
+    return 0;
+}
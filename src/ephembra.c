@@ -19,21 +19,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ephembra.h"
+#include "ephembra_cheb.h"
+#include "ephembra_pack.h"
+
+#if defined(__GNUC__)
+#define ephem_prefetch(p) __builtin_prefetch(p)
+#else
+#define ephem_prefetch(p)
+#endif
+
+/* decoded bytes cached for packed files that are loaded or mapped whole */
+#define DE440_PACK_BUDGET (1 << 20)
+/* bytes of legacy records read at a time for their bounds when paged */
+#define DE440_PAGE_CHUNK (1 << 20)
+/* largest fixed-layout body record, eight sub-intervals of 3 x 13 */
+#define DE440_FIXED_BODY 312
+
+/* dates in one chunk of a parallel batch */
+#define DE440_PARALLEL_GRAIN 1024
 
 #define VA_ARGS(...) , ##__VA_ARGS__
 #define ephem_error(fmt, ...) \
     fprintf(stderr, fmt "\n" VA_ARGS(__VA_ARGS__)); exit(1);
 
-typedef struct de440_dim de440_dim;
 typedef struct de440_idx de440_idx;
-
-struct de440_dim
-{
-    size_t dim[3];
-};
+typedef struct ephem_hdr ephem_hdr;
+typedef struct ephem_hdr_layout ephem_hdr_layout;
+typedef struct ephem_page ephem_page;
+typedef struct ephem_seg ephem_seg;
+typedef struct ephem_daf_seg ephem_daf_seg;
+typedef struct ephem_job ephem_job;
+typedef struct ephem_worker ephem_worker;
+typedef struct ephem_query ephem_query;
+typedef struct ephem_entry ephem_entry;
+typedef struct ephem_stripe ephem_stripe;
 
 struct de440_idx
 {
@@ -44,6 +74,61 @@ struct de440_idx
     size_t offset;
 };
 
+/*
+ * files start with the legacy {rows, cols} pair of size_t or this header,
+ * which is self-describing. it records the byte order, the coefficient
+ * format, the epoch span and record length, and the layout table gives
+ * each body's coefficient count, sub-interval step and offset, position
+ * error bound in metres, and the base and stride of its coefficients in
+ * elements from the end of the record bounds. the record bounds for all
+ * rows come first, in a block of doubles. row-major records pack each
+ * body's coefficients in object id order; body-major files store each
+ * body's coefficients for all rows contiguously. the data, the
+ * coefficients and each body's coefficients within a record start on
+ * 64-byte boundaries. a coefficient count of zero marks a body that is
+ * not stored, which evaluates to NaN.
+ *
+ * packed files hold row-major double records compressed in blocks of
+ * block_rows records. the record bounds are followed by block_rows, the
+ * block count and count + 1 block offsets relative to the first block.
+ */
+struct ephem_hdr
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint64_t rows;
+    uint64_t cols;
+    uint32_t format;
+    uint32_t nbody;
+    uint32_t byteorder;
+    uint32_t hsize;
+    double jd_start;
+    double jd_end;
+    double span;
+    uint64_t recbytes;
+    uint64_t tbytes;
+    uint64_t reserved;
+};
+
+struct ephem_hdr_layout
+{
+    uint32_t n;
+    uint32_t step;
+    uint32_t nsub;
+    uint32_t offset;
+    uint64_t base;
+    uint64_t stride;
+    double err;
+    uint64_t reserved;
+};
+
+#define DE440_VERSION 3
+#define DE440_ALIGN 64
+#define DE440_BYTEORDER 0x01020304u
+
+static const char ephem_magic[8] = { 'E', 'P', 'H', 'E', 'M', 'B', 'R', 'A' };
+
 const char* ephem_name[13] = {
     [ephem_id_Sun]          = "Sun",
     [ephem_id_Mercury]      = "Mercury",
@@ -53,7 +138,7 @@ const char* ephem_name[13] = {
     [ephem_id_Jupiter]      = "Jupiter",
     [ephem_id_Saturn]       = "Saturn",
     [ephem_id_Uranus]       = "Uranus",
-    [ephem_id_Neptune]      = "Neuptune",
+    [ephem_id_Neptune]      = "Neptune",
     [ephem_id_Pluto]        = "Pluto",
     [ephem_id_Moon]         = "Moon",
     [ephem_id_Nutations]    = "Nutations",
@@ -76,166 +161,3196 @@ const de440_idx ephem_idx[13] = {
     [ephem_id_Librations]   = { 899, 10, 929,  8, 30 }
 };
 
-void de440_create_ephem(ephem_ctx *ctx, const char *ephem_bin)
+static const de440_cheb3d_fixed_fn ephem_kern[13] = {
+    [ephem_id_Sun]          = de440_cheb3d_n11_s16_o33,
+    [ephem_id_Mercury]      = de440_cheb3d_n14_s8_o42,
+    [ephem_id_Venus]        = de440_cheb3d_n10_s16_o30,
+    [ephem_id_EarthMoon]    = de440_cheb3d_n13_s16_o39,
+    [ephem_id_Mars]         = de440_cheb3d_n11_s32_o0,
+    [ephem_id_Jupiter]      = de440_cheb3d_n8_s32_o0,
+    [ephem_id_Saturn]       = de440_cheb3d_n7_s32_o0,
+    [ephem_id_Uranus]       = de440_cheb3d_n6_s32_o0,
+    [ephem_id_Neptune]      = de440_cheb3d_n6_s32_o0,
+    [ephem_id_Pluto]        = de440_cheb3d_n6_s32_o0,
+    [ephem_id_Moon]         = de440_cheb3d_n13_s4_o39,
+    [ephem_id_Nutations]    = de440_cheb3d_n10_s8_o20,
+    [ephem_id_Librations]   = de440_cheb3d_n10_s8_o30
+};
+
+static const size_t ephem_order[13] = {
+    ephem_id_Mercury, ephem_id_Venus, ephem_id_EarthMoon, ephem_id_Mars,
+    ephem_id_Jupiter, ephem_id_Saturn, ephem_id_Uranus, ephem_id_Neptune,
+    ephem_id_Pluto, ephem_id_Moon, ephem_id_Sun, ephem_id_Nutations,
+    ephem_id_Librations
+};
+
+/*
+ * paged contexts keep the record bounds resident and read blocks of
+ * block_rows records on demand into a fixed set of pages, evicting the
+ * least recently used. block lookup is a direct index from block number
+ * to page. packed files always go through pages, which hold decoded
+ * blocks read from memory, or from the file when paged. readers copy
+ * coefficients out of a page under the pager lock, so a page can be
+ * evicted as soon as the lock is released. parallel batches give each
+ * thread a view with its own pages and lock over the shared index and
+ * record bounds.
+ */
+struct ephem_page
 {
-    FILE *f;
-    size_t dsize, nbytes;
+    size_t block;
+    uint64_t tick;
+    char *buf;
+};
 
-    f = fopen(ephem_bin, "r");
-    if (!f) {
-        ephem_error("fopen: failed: %s", ephem_bin);        
+struct ephem_pager
+{
+    int fd;
+    off_t data;
+    int contig;
+    const uint8_t *src;
+    uint64_t *index;
+    uint8_t *zbuf;
+    uint8_t *scratch;
+    double *tbuf;
+    size_t zmax;
+    size_t block_rows;
+    size_t nblocks;
+    size_t npages;
+    size_t page_size;
+    size_t first;
+    size_t recbytes;
+    size_t off[ephem_id_Last];
+    size_t pbase[ephem_id_Last];
+    size_t pstride[ephem_id_Last];
+    uint64_t tick;
+    size_t last;
+    uint32_t *slot;
+    ephem_page *page;
+    pthread_mutex_t lock;
+};
+
+/*
+ * chained contexts front several files. the covered dates are split into
+ * segments, each served by the first file given that covers it, and a
+ * bucket table over the whole range gives the first segment that may hold
+ * a date. rows are numbered across the files in the order given.
+ */
+struct ephem_seg
+{
+    double t1;
+    double t2;
+    size_t part;
+};
+
+struct ephem_chain
+{
+    size_t nparts;
+    ephem_ctx *part;
+    size_t *base;
+    size_t nseg;
+    ephem_seg *seg;
+    size_t nbucket;
+    size_t *bucket;
+    double t0;
+    double width;
+};
+
+/*
+ * SPK kernels are DAF files of 1024-byte records. summary records give
+ * each segment's NAIF target and center, its type and the 1-based
+ * addresses of its first and last double. type 2 and 3 segments hold
+ * equal-length Chebyshev records of {mid, radius, x, y, z} coefficients,
+ * type 3 adding velocity, and end with {init, intlen, rsize, count}.
+ * each body's records are the sub-intervals of a shared record span so
+ * coefficients are read in place from the mapping and the record bounds
+ * are computed. minus gives the base of a series subtracted from a body,
+ * for the geocentric Moon from kernels with the Moon and Earth relative
+ * to the Earth-Moon barycenter. bodies without a segment evaluate to NaN.
+ */
+struct ephem_daf_seg
+{
+    int32_t target;
+    int32_t center;
+    size_t begin;
+    double init;
+    size_t intlen;
+    size_t rsize;
+    size_t count;
+    size_t n;
+};
+
+/*
+ * tail bounds give, for each record and body, the position error in
+ * metres of keeping the first k of n coefficients, k from 0 to n: the
+ * largest over the sub-intervals of the norm of the per-axis sums of the
+ * dropped coefficient magnitudes. they are built on first use, kept as
+ * floats rounded up and published with a compare and swap, a thread that
+ * loses the race freeing its copy. nutations and librations are angles,
+ * not positions, and always keep all their coefficients.
+ */
+struct ephem_tail
+{
+    float *bound;
+    size_t base[ephem_id_Last];
+    size_t stride;
+};
+
+/*
+ * the result cache is a power of two table of entries probed linearly
+ * over a short window from the hash of the date bits, record and body.
+ * each entry is guarded by a sequence number that is odd while it is
+ * written, so readers never lock: a reader that sees the number change
+ * takes a miss, and a writer that finds an entry busy skips the store.
+ * the record is part of the key as the two records meeting at a boundary
+ * give slightly different results for the same date. hit and miss counts
+ * are kept in stripes on their own cache lines chosen by the hash, so
+ * threads rarely add to the same line.
+ */
+#define DE440_CACHE_PROBE 4
+#define DE440_CACHE_STRIPES 16
+
+struct ephem_entry
+{
+    atomic_uint_fast64_t seq;
+    atomic_uint_fast64_t jd;
+    atomic_uint_fast64_t tag;
+    atomic_uint_fast64_t v[9];
+};
+
+struct ephem_stripe
+{
+    _Alignas(64) atomic_size_t hits;
+    atomic_size_t misses;
+};
+
+struct ephem_cache
+{
+    ephem_entry *entry;
+    size_t mask;
+    ephem_stripe stripe[DE440_CACHE_STRIPES];
+};
+
+struct ephem_spk
+{
+    size_t minus[ephem_id_Last];
+    double *tbuf;
+    void *map;
+    size_t map_size;
+};
+
+static void de440_page_copy(ephem_ctx *ctx, size_t row, size_t oid,
+    size_t first, size_t n, double *buf);
+static void de440_pack_pages(ephem_ctx *ctx, size_t dsize);
+static void de440_pool_free(ephem_pool *pl);
+
+static inline const double* de440_row_time(ephem_ctx *ctx, size_t row)
+{
+    return ctx->PT + ctx->tstride * row;
+}
+
+static inline const double* de440_row_body(ephem_ctx *ctx, size_t row,
+    size_t oid)
+{
+    return ctx->PC + ctx->body[oid].base + ctx->body[oid].stride * row;
+}
+
+static inline const float* de440_row_body_f32(ephem_ctx *ctx, size_t row,
+    size_t oid)
+{
+    return ctx->PF + ctx->body[oid].base + ctx->body[oid].stride * row;
+}
+
+static const double* de440_spk_coeff(ephem_ctx *ctx, size_t row,
+    size_t oid, size_t sub, double *buf)
+{
+    const ephem_spk *sp = ctx->spk;
+    const ephem_body *b = &ctx->body[oid];
+    const double *C = de440_row_body(ctx, row, oid) + b->offset * sub, *M;
+
+    if (sp->minus[oid]) {
+        M = ctx->PC + sp->minus[oid] + b->stride * row + b->offset * sub;
+        for (size_t k = 0; k < 3 * b->n; k++) {
+            buf[k] = C[k] - M[k];
+        }
+        return buf;
+    }
+    return C;
+}
+
+/*
+ * coefficients for one sub-interval, x, y and z each n long. single
+ * precision files are widened into buf and paged records are copied
+ * into it, other doubles are returned in place. absent bodies have two
+ * NaN coefficients per component.
+ */
+static const double* de440_sub_coeff(ephem_ctx *ctx, size_t row,
+    size_t oid, size_t sub, double *buf)
+{
+    const ephem_body *b = &ctx->body[oid];
+
+    if (ctx->absent & (1u << oid)) {
+        for (size_t k = 0; k < 3 * b->n; k++) {
+            buf[k] = NAN;
+        }
+        return buf;
+    } else if (ctx->spk) {
+        return de440_spk_coeff(ctx, row, oid, sub, buf);
+    } else if (ctx->pager) {
+        de440_page_copy(ctx, row, oid, b->offset * sub, 3 * b->n, buf);
+        return buf;
+    } else if (ctx->format != ephem_format_f32) {
+        return de440_row_body(ctx, row, oid) + b->offset * sub;
+    } else {
+        const float *f = de440_row_body_f32(ctx, row, oid) + b->offset * sub;
+        for (size_t k = 0; k < 3 * b->n; k++) {
+            buf[k] = f[k];
+        }
+        return buf;
+    }
+}
+
+static inline size_t de440_format_size(size_t format)
+{
+    return format == ephem_format_f32 ? sizeof(float) : sizeof(double);
+}
+
+static inline size_t de440_align(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+static void* de440_alloc(size_t size)
+{
+    void *p = aligned_alloc(DE440_ALIGN, de440_align(size, DE440_ALIGN));
+    if (!p) {
+        ephem_error("aligned_alloc: failed to allocate %zu bytes", size);
     }
-    nbytes = fread(&ctx->rows, 1, sizeof(size_t), f);
-    if (nbytes != sizeof(size_t)) {
-        ephem_error("fread: invalid size: %zu != %zu", nbytes, sizeof(size_t));
+    return p;
+}
+
+/* elements per record used by a body: its sub-intervals and three axes */
+static size_t de440_body_size(ephem_ctx *ctx, size_t oid)
+{
+    const ephem_body *b = &ctx->body[oid];
+    return (b->nsub - 1) * b->offset + 3 * b->n;
+}
+
+/* the DE440 layout assumed for files without a layout table */
+static void de440_init_body(ephem_ctx *ctx, size_t oid, size_t n, double err)
+{
+    ephem_body *b = &ctx->body[oid];
+    b->n = n;
+    b->base = ephem_idx[oid].start - 1;
+    b->step = ephem_idx[oid].step;
+    b->nsub = DE440_FIXED_SPAN / b->step;
+    b->offset = n == ephem_idx[oid].addend ? ephem_idx[oid].offset : 3 * n;
+    b->err = err;
+}
+
+static size_t de440_data_size(ephem_ctx *ctx)
+{
+    size_t n = 0;
+    if (ctx->version == 0) {
+        return ctx->rows * ctx->cols * sizeof(double);
     }
-    nbytes = fread(&ctx->cols, 1, sizeof(size_t), f);
-    if (nbytes != sizeof(size_t)) {
-        ephem_error("fread: invalid size: %zu != %zu", nbytes, sizeof(size_t));
+    if (ctx->format == ephem_format_packed) {
+        return ctx->tbytes + 2 * sizeof(uint64_t);
     }
-    dsize = ctx->rows * ctx->cols * sizeof(double);
-    ctx->PC = malloc(dsize);
-    if (!ctx->PC) {
-        ephem_error("malloc: failed to allocate %zu bytes", dsize);
+    if (ctx->rows > 0) {
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            const ephem_body *b = &ctx->body[oid];
+            size_t end = b->base + b->stride * (ctx->rows - 1) +
+                de440_body_size(ctx, oid);
+            n = end > n ? end : n;
+        }
     }
-    nbytes = fread(ctx->PC, 1, dsize, f);
-    if (nbytes != dsize) {
-        ephem_error("fread: invalid size: %zu != %zu", nbytes, dsize);
+    return ctx->tbytes + n * de440_format_size(ctx->format);
+}
+
+static void de440_init_layout(ephem_ctx *ctx)
+{
+    ctx->fixed = ctx->format != ephem_format_f32;
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        ephem_body *b = &ctx->body[oid];
+        if (ctx->version == 0) {
+            if (b->base + de440_body_size(ctx, oid) > ctx->cols) {
+                ephem_error("layout: %s exceeds record: %zu > %zu",
+                    ephem_name[oid], b->base + de440_body_size(ctx, oid),
+                    ctx->cols);
+            }
+            b->stride = ctx->cols;
+        } else if (ctx->format == ephem_format_f64) {
+            b->base += ctx->tbytes / sizeof(double);
+        }
+        if (b->n != ephem_idx[oid].addend || b->step != ephem_idx[oid].step ||
+                b->offset != ephem_idx[oid].offset) {
+            ctx->fixed = 0;
+        }
     }
 
-    fclose(f);
+    if (!ctx->pager) {
+        ctx->PT = ctx->PC;
+        ctx->tstride = ctx->version == 0 ? ctx->cols : 2;
+        ctx->PF = ctx->format == ephem_format_f32 ?
+            (float*)((char*)ctx->PC + ctx->tbytes) : NULL;
+    }
+
+    if (ctx->rows > 0) {
+        ctx->jd_start = ctx->PT[0];
+        ctx->span = ctx->PT[1] - ctx->PT[0];
+    } else {
+        ctx->jd_start = 0;
+        ctx->span = 0;
+    }
+    if (ctx->span != DE440_FIXED_SPAN) {
+        ctx->fixed = 0;
+    }
 }
 
-void de440_destroy_ephem(ephem_ctx *ctx)
+static void de440_parse_layout(ephem_ctx *ctx, const ephem_hdr *hdr,
+    const char *buf)
 {
-    free(ctx->PC);
+    ephem_hdr_layout hl;
+
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        ephem_body *b = &ctx->body[oid];
+        memcpy(&hl, buf + oid * sizeof(hl), sizeof(hl));
+        if (hl.n == 0) {
+            ctx->absent |= 1u << oid;
+            de440_init_body(ctx, oid, 2, 0);
+            b->base = 0;
+            b->step = hdr->span;
+            b->nsub = 1;
+            b->offset = 0;
+            b->stride = 0;
+            continue;
+        }
+        if (hl.n < 2 || hl.n > ephem_max_coeff) {
+            ephem_error("header: invalid coefficient count: %u", hl.n);
+        }
+        if (hl.nsub == 0 || hl.step == 0 || hl.nsub * hl.step != hdr->span) {
+            ephem_error("header: invalid sub-intervals: %u x %u",
+                hl.nsub, hl.step);
+        }
+        if (hl.nsub > 1 && hl.offset == 0) {
+            ephem_error("header: invalid offset: %u", hl.offset);
+        }
+        b->n = hl.n;
+        b->step = hl.step;
+        b->nsub = hl.nsub;
+        b->offset = hl.offset;
+        b->base = hl.base;
+        b->stride = hl.stride;
+        b->err = hl.err;
+    }
 }
 
-static void de440_cheb3d(double jd, size_t n, double jd0, double jd1,
-    const double* Cx, const double* Cy, const double* Cz,
-    double *r, float scale)
+static size_t de440_parse_header(ephem_ctx *ctx, const char *buf, size_t len)
 {
-    double tau = 2*(jd - jd0)/(jd1 - jd0) - 1;
+    ephem_hdr hdr;
 
-    double Tx_prev = 1.0;
-    double Tx_curr = tau;
-    double sum_x = Cx[0] * Tx_prev + Cx[1] * Tx_curr;
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        de440_init_body(ctx, oid, ephem_idx[oid].addend, 0);
+    }
+    ctx->format = ephem_format_f64;
+    ctx->absent = 0;
 
-    double Ty_prev = 1.0;
-    double Ty_curr = tau;
-    double sum_y = Cy[0] * Ty_prev + Cy[1] * Ty_curr;
+    if (len < 2 * sizeof(size_t)) {
+        ephem_error("header: invalid size: %zu", len);
+    }
+    if (len < sizeof(ephem_magic) ||
+            memcmp(buf, ephem_magic, sizeof(ephem_magic)) != 0) {
+        memcpy(&ctx->rows, buf, sizeof(size_t));
+        memcpy(&ctx->cols, buf + sizeof(size_t), sizeof(size_t));
+        ctx->version = 0;
+        ctx->layout = ephem_layout_row;
+        ctx->tbytes = 0;
+        return 2 * sizeof(size_t);
+    }
+    if (len < sizeof(hdr)) {
+        ephem_error("header: invalid size: %zu < %zu", len, sizeof(hdr));
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    if (hdr.version != DE440_VERSION) {
+        ephem_error("header: unknown version: %u", hdr.version);
+    }
+    if (hdr.byteorder != DE440_BYTEORDER) {
+        ephem_error("header: unsupported byte order: %08x", hdr.byteorder);
+    }
+    if (hdr.layout != ephem_layout_row && hdr.layout != ephem_layout_body) {
+        ephem_error("header: unknown layout: %u", hdr.layout);
+    }
+    if (hdr.format != ephem_format_f64 && hdr.format != ephem_format_f32 &&
+            hdr.format != ephem_format_packed) {
+        ephem_error("header: unknown format: %u", hdr.format);
+    }
+    if (hdr.format == ephem_format_packed && hdr.layout != ephem_layout_row) {
+        ephem_error("header: invalid packed layout: %u", hdr.layout);
+    }
+    if (hdr.nbody != ephem_id_Last) {
+        ephem_error("header: invalid body count: %u", hdr.nbody);
+    }
+    if (hdr.hsize < sizeof(hdr) + hdr.nbody * sizeof(ephem_hdr_layout) ||
+            len < hdr.hsize) {
+        ephem_error("header: invalid size: %zu < %u", len, hdr.hsize);
+    }
+    if (hdr.tbytes < hdr.rows * 2 * sizeof(double)) {
+        ephem_error("header: invalid record bounds size: %zu",
+            (size_t)hdr.tbytes);
+    }
+    ctx->version = hdr.version;
+    ctx->rows = hdr.rows;
+    ctx->cols = hdr.cols;
+    ctx->layout = hdr.layout;
+    ctx->format = hdr.format;
+    ctx->tbytes = hdr.tbytes;
+    de440_parse_layout(ctx, &hdr, buf + sizeof(hdr));
+    return hdr.hsize;
+}
 
-    double Tz_prev = 1.0;
-    double Tz_curr = tau;
-    double sum_z = Cz[0] * Tz_prev + Cz[1] * Tz_curr;
+void de440_init_ephem(ephem_ctx *ctx, size_t rows, size_t cols, double *PC)
+{
+    ctx->rows = rows;
+    ctx->cols = cols;
+    ctx->PC = PC;
+    ctx->version = 0;
+    ctx->layout = ephem_layout_row;
+    ctx->format = ephem_format_f64;
+    ctx->tbytes = 0;
+    ctx->absent = 0;
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        de440_init_body(ctx, oid, ephem_idx[oid].addend, 0);
+    }
+    ctx->map = NULL;
+    ctx->map_size = 0;
+    ctx->pager = NULL;
+    ctx->chain = NULL;
+    ctx->spk = NULL;
+    ctx->tail = NULL;
+    ctx->cache = NULL;
+    ctx->pool = NULL;
 
-    for (size_t k = 2; k < n; ++k) {
-        double Tx_next = 2 * tau * Tx_curr - Tx_prev;
-        sum_x += Cx[k] * Tx_next;
-        Tx_prev = Tx_curr;
-        Tx_curr = Tx_next;
+    de440_init_layout(ctx);
+}
 
-        double Ty_next = 2 * tau * Ty_curr - Ty_prev;
-        sum_y += Cy[k] * Ty_next;
-        Ty_prev = Ty_curr;
-        Ty_curr = Ty_next;
+void de440_create_ephem(ephem_ctx *ctx, const char *ephem_bin)
+{
+    FILE *f;
+    char buf[4096];
+    size_t hsize, dsize, nbytes;
 
-        double Tz_next = 2 * tau * Tz_curr - Tz_prev;
-        sum_z += Cz[k] * Tz_next;
-        Tz_prev = Tz_curr;
-        Tz_curr = Tz_next;
+    ctx->map = NULL;
+    ctx->map_size = 0;
+    ctx->pager = NULL;
+    ctx->chain = NULL;
+    ctx->spk = NULL;
+    ctx->tail = NULL;
+    ctx->cache = NULL;
+    ctx->pool = NULL;
+
+    f = fopen(ephem_bin, "r");
+    if (!f) {
+        ephem_error("fopen: failed: %s", ephem_bin);
+    }
+    nbytes = fread(buf, 1, sizeof(buf), f);
+    hsize = de440_parse_header(ctx, buf, nbytes);
+    if (fseek(f, hsize, SEEK_SET) != 0) {
+        ephem_error("fseek: failed: %s", ephem_bin);
+    }
+    dsize = de440_data_size(ctx);
+    if (ctx->format == ephem_format_packed) {
+        struct stat st;
+        if (fstat(fileno(f), &st) < 0 || (size_t)st.st_size < hsize + dsize) {
+            ephem_error("fstat: invalid size: %s", ephem_bin);
+        }
+        dsize = st.st_size - hsize;
+    }
+    ctx->PC = de440_alloc(dsize);
+    nbytes = fread(ctx->PC, 1, dsize, f);
+    if (nbytes != dsize) {
+        ephem_error("fread: invalid size: %zu != %zu", nbytes, dsize);
     }
 
-    r[0] = sum_x * scale;
-    r[1] = sum_y * scale;
-    r[2] = sum_z * scale;
+    fclose(f);
+
+    de440_init_layout(ctx);
+    if (ctx->format == ephem_format_packed) {
+        de440_pack_pages(ctx, dsize);
+    }
 }
 
-static de440_dim de440_index(size_t start, size_t addend, size_t end)
+void de440_map_ephem(ephem_ctx *ctx, const char *ephem_bin, int flags)
 {
-    de440_dim x;
-    for (size_t i = 0; i < 3; i++) {
-        x.dim[i] = start - 1 + (addend * i);
+    struct stat st;
+    size_t hsize, dsize;
+    int fd, mflags = MAP_SHARED;
+    void *map;
+
+    fd = open(ephem_bin, O_RDONLY);
+    if (fd < 0) {
+        ephem_error("open: failed: %s", ephem_bin);
+    }
+    if (fstat(fd, &st) < 0) {
+        ephem_error("fstat: failed: %s", ephem_bin);
+    }
+    if ((size_t)st.st_size < 2 * sizeof(size_t)) {
+        ephem_error("mmap: invalid size: %zu < %zu",
+            (size_t)st.st_size, 2 * sizeof(size_t));
+    }
+#ifdef MAP_POPULATE
+    if (flags & ephem_map_populate) {
+        mflags |= MAP_POPULATE;
+    }
+#endif
+    map = mmap(NULL, st.st_size, PROT_READ, mflags, fd, 0);
+    if (map == MAP_FAILED) {
+        ephem_error("mmap: failed: %s", ephem_bin);
+    }
+    close(fd);
+#ifdef MADV_HUGEPAGE
+    if (flags & ephem_map_hugepage) {
+        madvise(map, st.st_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    hsize = de440_parse_header(ctx, map, st.st_size);
+    dsize = de440_data_size(ctx);
+    if ((size_t)st.st_size - hsize < dsize) {
+        ephem_error("mmap: invalid size: %zu < %zu",
+            (size_t)st.st_size - hsize, dsize);
+    }
+    ctx->PC = (double*)((char*)map + hsize);
+    ctx->map = map;
+    ctx->map_size = st.st_size;
+    ctx->pager = NULL;
+    ctx->chain = NULL;
+    ctx->spk = NULL;
+    ctx->tail = NULL;
+    ctx->cache = NULL;
+    ctx->pool = NULL;
+
+    de440_init_layout(ctx);
+    if (ctx->format == ephem_format_packed) {
+        de440_pack_pages(ctx, st.st_size - hsize);
     }
-    return x;
 }
 
-static de440_dim de440_add(de440_dim x, size_t a)
+/*
+ * embedded images are ephemeris files compiled into the program and used
+ * in place. map points at the image with a map size of zero, so destroy
+ * neither unmaps nor frees it.
+ */
+void de440_create_embedded(ephem_ctx *ctx, const void *image, size_t size)
 {
-    for (size_t i = 0; i < 3; i++) {
-        x.dim[i] += a;
+    size_t hsize, dsize;
+
+    if ((uintptr_t)image % sizeof(double) != 0) {
+        ephem_error("embedded: misaligned image: %p", image);
+    }
+    hsize = de440_parse_header(ctx, image, size);
+    dsize = de440_data_size(ctx);
+    if (size - hsize < dsize) {
+        ephem_error("embedded: invalid size: %zu < %zu", size - hsize, dsize);
+    }
+    ctx->PC = (double*)((const char*)image + hsize);
+    ctx->map = (void*)image;
+    ctx->map_size = 0;
+    ctx->pager = NULL;
+    ctx->chain = NULL;
+    ctx->spk = NULL;
+    ctx->tail = NULL;
+    ctx->cache = NULL;
+    ctx->pool = NULL;
+
+    de440_init_layout(ctx);
+    if (ctx->format == ephem_format_packed) {
+        de440_pack_pages(ctx, size - hsize);
     }
-    return x;
 }
 
-static size_t de440_interval(double dt, size_t step, size_t interval)
+/*
+ * JPL ASCII headers describe the record in GROUP 1030, the start, end and
+ * record span in days, and GROUP 1050, the 1-based start, coefficient
+ * count and sub-interval count of each item in the order Mercury to Pluto,
+ * Moon, Sun, nutations and librations. later items such as TT-TDB are not
+ * evaluated. nutations have two components, all other items three.
+ */
+static const char* de440_jpl_group(const char *buf, const char *group)
 {
-    for (size_t i = 0; i < interval; i += step) {
-        if (i <= dt && dt <= i + step) {
-            return i / step;
+    const char *p = buf;
+    while ((p = strstr(p, "GROUP")) != NULL) {
+        p += 5;
+        while (*p == ' ') {
+            p++;
+        }
+        if (strncmp(p, group, 4) == 0) {
+            return p + 4;
         }
     }
-    return interval / step;
+    ephem_error("header: missing GROUP %s", group);
+    return NULL;
 }
 
-static void de440_ephem_body(ephem_ctx *ctx, double jd, size_t row,
-    size_t start, size_t addend, size_t end,
-    size_t step, size_t offset, double *r)
+void de440_jpl_layout(ephem_ctx *ctx, const char *jpl_header)
 {
-    de440_dim temp;
-    double *PC, t1, dt, jd0, *Cx, *Cy, *Cz, s = 1e3;
-    size_t i;
+    FILE *f;
+    struct stat st;
+    const char *p;
+    char *buf, *e;
+    size_t nbytes, nitem = 0, item[3][16];
+    double span;
+
+    if (ctx->version != 0 || ctx->pager) {
+        ephem_error("header: layout applies to legacy files: %s",
+            jpl_header);
+    }
+    f = fopen(jpl_header, "r");
+    if (!f || fstat(fileno(f), &st) < 0) {
+        ephem_error("fopen: failed: %s", jpl_header);
+    }
+    buf = malloc(st.st_size + 1);
+    if (!buf) {
+        ephem_error("malloc: failed to allocate %zu bytes",
+            (size_t)st.st_size + 1);
+    }
+    nbytes = fread(buf, 1, st.st_size, f);
+    buf[nbytes] = 0;
+    fclose(f);
 
-    PC = ctx->PC + ctx->cols * row;
+    p = strstr(buf, "NCOEFF=");
+    if (p && strtoul(p + 7, NULL, 10) != ctx->cols) {
+        ephem_error("header: record length %zu != %zu",
+            (size_t)strtoul(p + 7, NULL, 10), ctx->cols);
+    }
+
+    p = de440_jpl_group(buf, "1030");
+    strtod(p, &e);
+    strtod(e, &e);
+    span = strtod(e, NULL);
+    if (!(span > 0) || span != floor(span) ||
+            (ctx->rows > 0 && span != ctx->span)) {
+        ephem_error("header: invalid record span: %g", span);
+    }
+
+    /* the first row of GROUP 1050 gives the item count */
+    p = de440_jpl_group(buf, "1050");
+    p += strspn(p, " \t\r\n");
+    while (*p && *p != '\n' && nitem < 16) {
+        item[0][nitem++] = strtoul(p, &e, 10);
+        if (e == p) {
+            break;
+        }
+        p = e + strspn(e, " \t\r");
+    }
+    if (nitem < ephem_id_Last) {
+        ephem_error("header: invalid item count: %zu", nitem);
+    }
+    for (size_t r = 1; r < 3; r++) {
+        for (size_t i = 0; i < nitem; i++, p = e) {
+            item[r][i] = strtoul(p, &e, 10);
+            if (e == p) {
+                ephem_error("header: truncated GROUP %s", "1050");
+            }
+        }
+    }
 
-    t1 = PC[0];
-    dt = jd - t1;
-    i = de440_interval(dt, step, 32);
-    temp = de440_index(start, addend, end);
-    temp = de440_add(temp, offset * i);
-    jd0 = t1 + step * i;
-    Cx = PC + temp.dim[0];
-    Cy = PC + temp.dim[1];
-    Cz = PC + temp.dim[2];
+    for (size_t i = 0; i < ephem_id_Last; i++) {
+        size_t oid = ephem_order[i], start = item[0][i];
+        size_t n = item[1][i], nsub = item[2][i];
+        ephem_body *b = &ctx->body[oid];
+        if (start < 3 || n < 2 || n > ephem_max_coeff || nsub == 0 ||
+                (size_t)span % nsub != 0) {
+            ephem_error("header: invalid layout for %s: %zu %zu %zu",
+                ephem_name[oid], start, n, nsub);
+        }
+        b->base = start - 1;
+        b->n = n;
+        b->nsub = nsub;
+        b->step = (size_t)span / nsub;
+        b->offset = nsub == 1 ? 0 : (oid == ephem_id_Nutations ? 2 : 3) * n;
+        b->err = 0;
+    }
+    free(buf);
+    de440_init_layout(ctx);
+}
 
-    de440_cheb3d(jd, addend, jd0, jd0 + step, Cx, Cy, Cz, r, s);    
+static void de440_pread(int fd, void *buf, size_t len, off_t off)
+{
+    while (len > 0) {
+        ssize_t nbytes = pread(fd, buf, len, off);
+        if (nbytes <= 0) {
+            ephem_error("pread: failed at offset %zu", (size_t)off);
+        }
+        buf = (char*)buf + nbytes;
+        len -= nbytes;
+        off += nbytes;
+    }
 }
 
-static inline int de440_cmp(ephem_ctx *ctx, double jd, size_t row)
+static size_t de440_block_rows(ephem_pager *pg, ephem_ctx *ctx, size_t block)
 {
-    size_t c = ctx->cols;
-    double *d = ctx->PC + c * row;
-    double jd1 = d[0], jd2 = d[1];
-    if (jd < jd1) return -1;
-    else if (jd > jd2) return 1;
-    else return 0;
+    size_t r0 = block * pg->block_rows;
+    return ctx->rows - r0 < pg->block_rows ? ctx->rows - r0 : pg->block_rows;
 }
 
-size_t de440_find_row(ephem_ctx *ctx, double jd)
+static void de440_page_advise(ephem_pager *pg, ephem_ctx *ctx, size_t block)
 {
-    size_t n = ctx->rows;
-    size_t begin = 0, end = n;
-    while (end != 0) {
-        size_t half = (end >> 1), probe = begin + half;
-        if (de440_cmp(ctx, jd, probe) > 0) {
-            begin = probe + 1;
-            end -= half + 1;
-        } else {
-            end = half;
+#ifdef POSIX_FADV_WILLNEED
+    size_t r0 = block * pg->block_rows;
+    size_t nrows = de440_block_rows(pg, ctx, block);
+
+    if (pg->fd < 0) {
+        return;
+    }
+    if (pg->index) {
+        posix_fadvise(pg->fd, pg->data + pg->first + pg->index[block],
+            pg->index[block + 1] - pg->index[block], POSIX_FADV_WILLNEED);
+    } else if (pg->contig) {
+        posix_fadvise(pg->fd, pg->data + pg->first + r0 * pg->recbytes,
+            nrows * pg->recbytes, POSIX_FADV_WILLNEED);
+    } else {
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            posix_fadvise(pg->fd, pg->data + pg->off[oid] +
+                r0 * pg->pstride[oid], nrows * pg->pstride[oid],
+                POSIX_FADV_WILLNEED);
         }
     }
-    return de440_cmp(ctx, jd, begin) == 0 ? begin : -1;
+#endif
 }
 
-void de440_ephem_obj(ephem_ctx *ctx, double jd, size_t row, size_t oid, 
-    double *obj)
+static void de440_page_load(ephem_pager *pg, ephem_ctx *ctx,
+    ephem_page *p, size_t block)
 {
-    if (row == -1) {
-        obj[0] = NAN; obj[1] = NAN; obj[2] = NAN;
+    size_t r0 = block * pg->block_rows;
+    size_t nrows = de440_block_rows(pg, ctx, block);
+
+    if (pg->index) {
+        size_t len = pg->index[block + 1] - pg->index[block];
+        const uint8_t *z = pg->src ? pg->src + pg->index[block] : pg->zbuf;
+        if (!pg->src) {
+            de440_pread(pg->fd, pg->zbuf, len,
+                pg->data + pg->first + pg->index[block]);
+        }
+        if (de440_unpack_block(z, len, nrows, pg->recbytes / sizeof(double),
+                (uint64_t*)p->buf, pg->scratch) < 0) {
+            ephem_error("unpack: corrupt block: %zu", block);
+        }
+    } else if (pg->contig) {
+        de440_pread(pg->fd, p->buf, nrows * pg->recbytes,
+            pg->data + pg->first + r0 * pg->recbytes);
     } else {
-        de440_ephem_body(ctx, jd, row, ephem_idx[oid].start,
-            ephem_idx[oid].addend, ephem_idx[oid].end,
-            ephem_idx[oid].step, ephem_idx[oid].offset, obj);
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            de440_pread(pg->fd, p->buf + pg->pbase[oid],
+                nrows * pg->pstride[oid],
+                pg->data + pg->off[oid] + r0 * pg->pstride[oid]);
+        }
+    }
+}
+
+static const char* de440_page_body(ephem_ctx *ctx, size_t row, size_t oid)
+{
+    ephem_pager *pg = ctx->pager;
+    size_t block = row / pg->block_rows;
+    uint32_t slot = pg->slot[block];
+    ephem_page *p;
+
+    if (slot) {
+        p = &pg->page[slot - 1];
+    } else {
+        p = &pg->page[0];
+        for (size_t i = 1; i < pg->npages; i++) {
+            if (pg->page[i].tick < p->tick) {
+                p = &pg->page[i];
+            }
+        }
+        if (p->block != (size_t)-1) {
+            pg->slot[p->block] = 0;
+        }
+        de440_page_load(pg, ctx, p, block);
+        p->block = block;
+        pg->slot[block] = (uint32_t)(p - pg->page) + 1;
+
+        /* read ahead in the direction of travel */
+        if (block >= pg->last && block + 1 < pg->nblocks) {
+            de440_page_advise(pg, ctx, block + 1);
+        } else if (block < pg->last && block > 0) {
+            de440_page_advise(pg, ctx, block - 1);
+        }
+        pg->last = block;
+    }
+    p->tick = ++pg->tick;
+
+    return p->buf + pg->pbase[oid] +
+        (row - block * pg->block_rows) * pg->pstride[oid];
+}
+
+/* n coefficients of a paged record from first on, widened to double */
+static void de440_page_copy(ephem_ctx *ctx, size_t row, size_t oid,
+    size_t first, size_t n, double *buf)
+{
+    ephem_pager *pg = ctx->pager;
+    const char *p;
+
+    pthread_mutex_lock(&pg->lock);
+    p = de440_page_body(ctx, row, oid);
+    if (ctx->format == ephem_format_f32) {
+        const float *f = (const float*)p + first;
+        for (size_t k = 0; k < n; k++) {
+            buf[k] = f[k];
+        }
+    } else {
+        memcpy(buf, (const double*)p + first, n * sizeof(double));
+    }
+    pthread_mutex_unlock(&pg->lock);
+}
+
+/*
+ * the packed block index follows the record bounds. src is the mapped or
+ * loaded data, or NULL when the index and blocks are read from the file.
+ */
+static void de440_pager_index(ephem_pager *pg, ephem_ctx *ctx,
+    const char *src, size_t dsize)
+{
+    size_t tsize = ctx->tbytes;
+    uint64_t hdr[2];
+    size_t isize, zmax = 0;
+
+    if (src) {
+        memcpy(hdr, src + tsize, sizeof(hdr));
+    } else {
+        de440_pread(pg->fd, hdr, sizeof(hdr), pg->data + tsize);
+    }
+    if (hdr[0] == 0 || hdr[1] != (ctx->rows + hdr[0] - 1) / hdr[0]) {
+        ephem_error("packed: invalid block count: %zu", (size_t)hdr[1]);
+    }
+    pg->block_rows = hdr[0];
+    pg->nblocks = hdr[1];
+    isize = (pg->nblocks + 1) * sizeof(uint64_t);
+    if (dsize < tsize + sizeof(hdr) + isize) {
+        ephem_error("packed: invalid size: %zu", dsize);
+    }
+    pg->index = malloc(isize);
+    if (!pg->index) {
+        ephem_error("malloc: failed to allocate %zu bytes", isize);
+    }
+    if (src) {
+        memcpy(pg->index, src + tsize + sizeof(hdr), isize);
+    } else {
+        de440_pread(pg->fd, pg->index, isize, pg->data + tsize + sizeof(hdr));
+    }
+    pg->first = tsize + sizeof(hdr) + isize;
+    for (size_t b = 0; b < pg->nblocks; b++) {
+        if (pg->index[b + 1] < pg->index[b]) {
+            ephem_error("packed: invalid block offset: %zu", b);
+        }
+        if (pg->index[b + 1] - pg->index[b] > zmax) {
+            zmax = pg->index[b + 1] - pg->index[b];
+        }
+    }
+    if (pg->index[pg->nblocks] > dsize - pg->first) {
+        ephem_error("packed: invalid size: %zu < %zu",
+            dsize - pg->first, (size_t)pg->index[pg->nblocks]);
+    }
+    pg->zmax = zmax;
+    if (src) {
+        pg->src = (const uint8_t*)src + pg->first;
+    } else {
+        pg->zbuf = malloc(zmax);
+        if (!pg->zbuf) {
+            ephem_error("malloc: failed to allocate %zu bytes", zmax);
+        }
+    }
+}
+
+static void de440_pager_pages(ephem_pager *pg, size_t npages)
+{
+    pg->npages = npages < 2 ? 2 : npages;
+    if (pg->npages > pg->nblocks) {
+        pg->npages = pg->nblocks;
+    }
+    pg->slot = calloc(pg->nblocks, sizeof(uint32_t));
+    pg->page = calloc(pg->npages, sizeof(ephem_page));
+    if (!pg->slot || !pg->page) {
+        ephem_error("calloc: failed to allocate %zu pages", pg->npages);
+    }
+    for (size_t i = 0; i < pg->npages; i++) {
+        pg->page[i].block = -1;
+        pg->page[i].buf = de440_alloc(pg->page_size);
+    }
+}
+
+/* frees the pages and buffers that a pager does not share with views */
+static void de440_pager_free(ephem_pager *pg)
+{
+    for (size_t i = 0; i < pg->npages; i++) {
+        free(pg->page[i].buf);
+    }
+    free(pg->page);
+    free(pg->slot);
+    free(pg->zbuf);
+    free(pg->scratch);
+    pthread_mutex_destroy(&pg->lock);
+}
+
+/*
+ * row-major records are read as whole runs of records. body-major
+ * blocks gather each body's run of records into its own slice.
+ */
+static void de440_pager_init(ephem_pager *pg, ephem_ctx *ctx,
+    size_t block_rows, size_t budget)
+{
+    size_t esize = de440_format_size(ctx->format);
+    size_t tsize = ctx->tbytes;
+
+    if (!pg->index) {
+        pg->block_rows = block_rows ? block_rows : 16;
+        pg->nblocks = (ctx->rows + pg->block_rows - 1) / pg->block_rows;
+        pg->first = ctx->version == 0 ? 0 : tsize;
+    }
+    pg->contig = ctx->version == 0 || ctx->layout == ephem_layout_row;
+    pg->recbytes = 0;
+    pg->page_size = 0;
+    /* absent bodies have no stride, the record is the widest */
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        if (pg->recbytes < ctx->body[oid].stride * esize) {
+            pg->recbytes = ctx->body[oid].stride * esize;
+        }
+    }
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        ephem_body *b = &ctx->body[oid];
+        pg->off[oid] = ctx->format == ephem_format_f32 ?
+            tsize + b->base * esize : b->base * esize;
+        if (pg->index) {
+            pg->pbase[oid] = pg->off[oid];
+            pg->pstride[oid] = pg->recbytes;
+        } else if (pg->contig) {
+            pg->pbase[oid] = pg->off[oid] - pg->first;
+            pg->pstride[oid] = pg->recbytes;
+        } else {
+            pg->pbase[oid] = pg->page_size;
+            pg->pstride[oid] = b->stride * esize;
+            pg->page_size += pg->block_rows * pg->pstride[oid];
+        }
+    }
+    if (pg->contig) {
+        pg->page_size = pg->block_rows * pg->recbytes;
+    }
+    if (pg->index) {
+        pg->scratch = malloc(pg->page_size);
+        if (!pg->scratch) {
+            ephem_error("malloc: failed to allocate %zu bytes", pg->page_size);
+        }
+    }
+
+    de440_pager_pages(pg, budget / pg->page_size);
+    ctx->pager = pg;
+}
+
+static ephem_pager* de440_pager_new(int fd, size_t data)
+{
+    ephem_pager *pg = calloc(1, sizeof(ephem_pager));
+    if (!pg) {
+        ephem_error("calloc: failed to allocate %zu bytes",
+            sizeof(ephem_pager));
+    }
+    pg->fd = fd;
+    pg->data = data;
+    pthread_mutex_init(&pg->lock, NULL);
+    return pg;
+}
+
+/*
+ * a view shares the file, block index and record bounds of a pager and
+ * has as many pages of its own.
+ */
+static ephem_pager* de440_pager_view(const ephem_pager *src)
+{
+    ephem_pager *pg = de440_pager_new(src->fd, src->data);
+
+    *pg = *src;
+    pthread_mutex_init(&pg->lock, NULL);
+    pg->zbuf = NULL;
+    pg->scratch = NULL;
+    pg->tick = 0;
+    pg->last = 0;
+    if (pg->index && !pg->src) {
+        pg->zbuf = malloc(pg->zmax);
+        if (!pg->zbuf) {
+            ephem_error("malloc: failed to allocate %zu bytes", pg->zmax);
+        }
+    }
+    if (pg->index) {
+        pg->scratch = malloc(pg->page_size);
+        if (!pg->scratch) {
+            ephem_error("malloc: failed to allocate %zu bytes", pg->page_size);
+        }
+    }
+    de440_pager_pages(pg, src->npages);
+    return pg;
+}
+
+/* packed files loaded or mapped whole decode through a small page cache */
+static void de440_pack_pages(ephem_ctx *ctx, size_t dsize)
+{
+    ephem_pager *pg = de440_pager_new(-1, 0);
+    de440_pager_index(pg, ctx, (const char*)ctx->PC, dsize);
+    de440_pager_init(pg, ctx, 0, DE440_PACK_BUDGET);
+}
+
+void de440_page_ephem(ephem_ctx *ctx, const char *ephem_bin,
+    size_t block_rows, size_t budget)
+{
+    ephem_pager *pg;
+    char buf[4096];
+    size_t hsize, tsize;
+    ssize_t len;
+    off_t fsize;
+    int fd;
+
+    ctx->PC = NULL;
+    ctx->map = NULL;
+    ctx->map_size = 0;
+    ctx->chain = NULL;
+    ctx->spk = NULL;
+    ctx->tail = NULL;
+    ctx->cache = NULL;
+    ctx->pool = NULL;
+
+    fd = open(ephem_bin, O_RDONLY);
+    if (fd < 0) {
+        ephem_error("open: failed: %s", ephem_bin);
+    }
+    len = pread(fd, buf, sizeof(buf), 0);
+    if (len < 0) {
+        ephem_error("pread: failed: %s", ephem_bin);
+    }
+    hsize = de440_parse_header(ctx, buf, len);
+    if (ctx->rows == 0) {
+        ephem_error("page: no records: %s", ephem_bin);
+    }
+    fsize = lseek(fd, 0, SEEK_END);
+    if ((size_t)fsize < hsize + de440_data_size(ctx)) {
+        ephem_error("page: invalid size: %zu < %zu",
+            (size_t)fsize - hsize, de440_data_size(ctx));
+    }
+    pg = de440_pager_new(fd, hsize);
+
+    tsize = 2 * ctx->rows * sizeof(double);
+    pg->tbuf = malloc(tsize);
+    if (!pg->tbuf) {
+        ephem_error("malloc: failed to allocate %zu bytes", tsize);
+    }
+    if (ctx->version == 0) {
+        /* legacy bounds lead each record, read runs of whole records */
+        size_t rec = ctx->cols * sizeof(double);
+        size_t step = rec < DE440_PAGE_CHUNK ? DE440_PAGE_CHUNK / rec : 1;
+        double *chunk = malloc(step * rec);
+        if (!chunk) {
+            ephem_error("malloc: failed to allocate %zu bytes", step * rec);
+        }
+        for (size_t row = 0; row < ctx->rows; row += step) {
+            size_t n = ctx->rows - row < step ? ctx->rows - row : step;
+            de440_pread(fd, chunk, n * rec, hsize + row * rec);
+            for (size_t k = 0; k < n; k++) {
+                pg->tbuf[2 * (row + k)] = chunk[k * ctx->cols];
+                pg->tbuf[2 * (row + k) + 1] = chunk[k * ctx->cols + 1];
+            }
+        }
+        free(chunk);
+    } else {
+        de440_pread(fd, pg->tbuf, tsize, hsize);
+    }
+    ctx->PT = pg->tbuf;
+    ctx->tstride = 2;
+    ctx->PF = NULL;
+    ctx->pager = pg;
+    de440_init_layout(ctx);
+
+    if (ctx->format == ephem_format_packed) {
+        de440_pager_index(pg, ctx, NULL, fsize - hsize);
+    }
+    de440_pager_init(pg, ctx, block_rows, budget);
+}
+
+static int de440_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void* de440_calloc(size_t n, size_t size)
+{
+    void *p = calloc(n, size);
+    if (!p) {
+        ephem_error("calloc: failed to allocate %zu bytes", n * size);
+    }
+    return p;
+}
+
+static void de440_chain_index(ephem_chain *ch)
+{
+    size_t nb = 0, i = 0;
+    double *b = de440_calloc(2 * ch->nparts, sizeof(double));
+
+    for (size_t p = 0; p < ch->nparts; p++) {
+        ephem_ctx *part = &ch->part[p];
+        b[nb++] = de440_row_time(part, 0)[0];
+        b[nb++] = de440_row_time(part, part->rows - 1)[1];
+    }
+    qsort(b, nb, sizeof(double), de440_cmp_double);
+
+    ch->seg = de440_calloc(nb, sizeof(ephem_seg));
+    ch->nseg = 0;
+    for (size_t k = 0; k + 1 < nb; k++) {
+        size_t p;
+        if (b[k] == b[k + 1]) {
+            continue;
+        }
+        for (p = 0; p < ch->nparts; p++) {
+            ephem_ctx *part = &ch->part[p];
+            if (de440_row_time(part, 0)[0] <= b[k] &&
+                    b[k + 1] <= de440_row_time(part, part->rows - 1)[1]) {
+                break;
+            }
+        }
+        if (p == ch->nparts) {
+            continue;
+        }
+        if (ch->nseg > 0 && ch->seg[ch->nseg - 1].part == p &&
+                ch->seg[ch->nseg - 1].t2 == b[k]) {
+            ch->seg[ch->nseg - 1].t2 = b[k + 1];
+        } else {
+            ch->seg[ch->nseg++] = (ephem_seg) { b[k], b[k + 1], p };
+        }
+    }
+    free(b);
+
+    /* each bucket starts one segment early to absorb rounding */
+    ch->t0 = ch->seg[0].t1;
+    ch->nbucket = 4 * ch->nseg;
+    ch->width = (ch->seg[ch->nseg - 1].t2 - ch->t0) / ch->nbucket;
+    ch->bucket = de440_calloc(ch->nbucket, sizeof(size_t));
+    for (size_t k = 0; k < ch->nbucket; k++) {
+        while (i + 1 < ch->nseg && ch->seg[i].t2 < ch->t0 + k * ch->width) {
+            i++;
+        }
+        ch->bucket[k] = i > 0 ? i - 1 : 0;
+    }
+}
+
+/* segment holding a date, records ending a segment hold their end date */
+static size_t de440_chain_seg(ephem_chain *ch, double jd)
+{
+    double r = floor((jd - ch->t0) / ch->width);
+    size_t i;
+
+    if (!(r >= 0)) {
+        return -1;
+    }
+    i = ch->bucket[r < ch->nbucket ? (size_t)r : ch->nbucket - 1];
+    while (i + 1 < ch->nseg && jd >= ch->seg[i + 1].t1) {
+        i++;
+    }
+    return jd >= ch->seg[i].t1 && jd <= ch->seg[i].t2 ? i : -1;
+}
+
+/* file serving a date and the number of its first row in the chain */
+static ephem_ctx* de440_chain_find(ephem_ctx *ctx, double jd, size_t *base)
+{
+    ephem_chain *ch = ctx->chain;
+    size_t i = de440_chain_seg(ch, jd);
+
+    if (i == -1) {
+        return NULL;
+    }
+    *base = ch->base[ch->seg[i].part];
+    return &ch->part[ch->seg[i].part];
+}
+
+/* file holding a chain row, which becomes the row within the file */
+static ephem_ctx* de440_chain_row(ephem_ctx *ctx, size_t *row)
+{
+    ephem_chain *ch = ctx->chain;
+    size_t p = ch->nparts - 1;
+
+    while (p > 0 && *row < ch->base[p]) {
+        p--;
+    }
+    *row -= ch->base[p];
+    return &ch->part[p];
+}
+
+static ephem_chain* de440_chain_new(size_t n)
+{
+    ephem_chain *ch = de440_calloc(1, sizeof(ephem_chain));
+    ch->nparts = n;
+    ch->part = de440_calloc(n, sizeof(ephem_ctx));
+    ch->base = de440_calloc(n, sizeof(size_t));
+    return ch;
+}
+
+/* front the loaded parts of a chain with ctx */
+static void de440_chain_init(ephem_ctx *ctx, ephem_chain *ch)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    for (size_t p = 0; p < ch->nparts; p++) {
+        ephem_ctx *part = &ch->part[p];
+        ch->base[p] = ctx->rows;
+        ctx->rows += part->rows;
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            if (p == 0 || part->body[oid].err > ctx->body[oid].err) {
+                ctx->body[oid] = part->body[oid];
+            }
+        }
+    }
+    de440_chain_index(ch);
+
+    ctx->cols = ch->part[0].cols;
+    ctx->version = DE440_VERSION;
+    ctx->layout = ch->part[0].layout;
+    ctx->format = ch->part[0].format;
+    ctx->jd_start = ch->t0;
+    ctx->chain = ch;
+}
+
+void de440_chain_ephem(ephem_ctx *ctx, const char **ephem_bin, size_t n,
+    int flags)
+{
+    ephem_chain *ch;
+
+    if (n == 0) {
+        ephem_error("chain: no files: %zu", n);
+    }
+    ch = de440_chain_new(n);
+    for (size_t p = 0; p < n; p++) {
+        de440_map_ephem(&ch->part[p], ephem_bin[p], flags);
+        if (ch->part[p].rows == 0) {
+            ephem_error("chain: no records: %s", ephem_bin[p]);
+        }
+    }
+    de440_chain_init(ctx, ch);
+}
+
+/* NAIF ids of the bodies read from SPK kernels, all relative to the SSB */
+static const int32_t ephem_naif[13] = {
+    [ephem_id_Sun]          = 10,
+    [ephem_id_Mercury]      = 1,
+    [ephem_id_Venus]        = 2,
+    [ephem_id_EarthMoon]    = 3,
+    [ephem_id_Mars]         = 4,
+    [ephem_id_Jupiter]      = 5,
+    [ephem_id_Saturn]       = 6,
+    [ephem_id_Uranus]       = 7,
+    [ephem_id_Neptune]      = 8,
+    [ephem_id_Pluto]        = 9,
+    [ephem_id_Moon]         = 301,
+    [ephem_id_Nutations]    = -1,
+    [ephem_id_Librations]   = -1
+};
+
+#define DE440_DAF_RECORD 1024
+#define DE440_J2000 2451545.0
+#define DE440_DAY 86400
+
+static size_t de440_daf_segs(const char *map, size_t size,
+    ephem_daf_seg **out)
+{
+    ephem_daf_seg *seg = NULL;
+    size_t nseg = 0, cap = 0, rec, nrec = 0;
+    const double *D = (const double*)map;
+    int32_t nd, ni, fward;
+
+    if (size < DE440_DAF_RECORD || memcmp(map, "DAF/SPK ", 8) != 0) {
+        ephem_error("spk: not a DAF/SPK file: %zu bytes", size);
+    }
+    if (memcmp(map + 88, "LTL-IEEE", 8) != 0) {
+        ephem_error("spk: unsupported byte order: %.8s", map + 88);
+    }
+    memcpy(&nd, map + 8, sizeof(nd));
+    memcpy(&ni, map + 12, sizeof(ni));
+    memcpy(&fward, map + 76, sizeof(fward));
+    if (nd != 2 || ni != 6) {
+        ephem_error("spk: invalid summary format: %d %d", nd, ni);
+    }
+
+    for (rec = fward; rec != 0; rec = (size_t)D[(rec - 1) * 128]) {
+        const double *d = D + (rec - 1) * 128;
+        size_t nsum = (size_t)d[2];
+        if (rec * DE440_DAF_RECORD > size || nsum > 25 ||
+                ++nrec > size / DE440_DAF_RECORD) {
+            ephem_error("spk: invalid summary record: %zu", rec);
+        }
+        for (size_t i = 0; i < nsum; i++) {
+            ephem_daf_seg sg;
+            const double *t;
+            int32_t ints[6];
+            size_t ncomp;
+
+            memcpy(ints, d + 3 + i * 5 + 2, sizeof(ints));
+            if (ints[3] != 2 && ints[3] != 3) {
+                continue;
+            }
+            if (ints[4] < 1 || ints[5] < ints[4] + 3 ||
+                    (size_t)ints[5] * sizeof(double) > size) {
+                ephem_error("spk: invalid segment: %d %d", ints[4], ints[5]);
+            }
+            t = D + ints[5] - 4;
+            ncomp = ints[3] == 2 ? 3 : 6;
+            sg.target = ints[0];
+            sg.center = ints[1];
+            sg.begin = ints[4] - 1;
+            sg.init = t[0];
+            sg.intlen = (size_t)t[1];
+            sg.rsize = (size_t)t[2];
+            sg.count = (size_t)t[3];
+            sg.n = sg.rsize > 2 ? (sg.rsize - 2) / ncomp : 0;
+            if (sg.n < 2 || sg.n > ephem_max_coeff ||
+                    sg.rsize != 2 + ncomp * sg.n ||
+                    sg.count * sg.rsize + 4 != (size_t)ints[5] - sg.begin) {
+                ephem_error("spk: invalid records for %d: %zu x %zu",
+                    sg.target, sg.count, sg.rsize);
+            }
+            if (sg.intlen == 0 || t[1] != sg.intlen ||
+                    sg.intlen % DE440_DAY != 0) {
+                ephem_error("spk: records are not whole days for %d: %g",
+                    sg.target, t[1]);
+            }
+            if (nseg == cap) {
+                cap = cap ? cap * 2 : 16;
+                seg = realloc(seg, cap * sizeof(ephem_daf_seg));
+                if (!seg) {
+                    ephem_error("realloc: failed to allocate %zu bytes",
+                        cap * sizeof(ephem_daf_seg));
+                }
+            }
+            seg[nseg++] = sg;
+        }
+    }
+    *out = seg;
+    return nseg;
+}
+
+static const ephem_daf_seg* de440_daf_find(const ephem_daf_seg *seg,
+    size_t nseg, double init, double end, int32_t target, int32_t center)
+{
+    for (size_t i = 0; i < nseg; i++) {
+        if (seg[i].target == target && seg[i].center == center &&
+                seg[i].init == init &&
+                seg[i].init + (double)seg[i].intlen * seg[i].count == end) {
+            return &seg[i];
+        }
+    }
+    return NULL;
+}
+
+/* a context over the segments covering [init, end) seconds */
+static void de440_spk_part(ephem_ctx *ctx, const char *map,
+    const ephem_daf_seg *seg, size_t nseg, double init, double end)
+{
+    const ephem_daf_seg *bs[ephem_id_Last], *ms = NULL;
+    ephem_spk *sp = de440_calloc(1, sizeof(ephem_spk));
+    size_t span = 0, rows;
+
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        bs[oid] = NULL;
+        if (oid == ephem_id_Moon) {
+            bs[oid] = de440_daf_find(seg, nseg, init, end, 301, 399);
+            if (!bs[oid]) {
+                bs[oid] = de440_daf_find(seg, nseg, init, end, 301, 3);
+                ms = de440_daf_find(seg, nseg, init, end, 399, 3);
+                if (!bs[oid] || !ms || ms->intlen != bs[oid]->intlen ||
+                        ms->rsize != bs[oid]->rsize) {
+                    bs[oid] = NULL;
+                }
+            }
+        } else if (ephem_naif[oid] > 0) {
+            bs[oid] = de440_daf_find(seg, nseg, init, end,
+                ephem_naif[oid], 0);
+        }
+        if (bs[oid] && bs[oid]->intlen > span) {
+            span = bs[oid]->intlen;
+        }
+    }
+    if (span == 0) {
+        ephem_error("spk: no ephemeris segments at %g", init);
+    }
+    rows = (size_t)((end - init) / span);
+    if ((double)rows * span != end - init) {
+        ephem_error("spk: segments are not whole records at %g", init);
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->rows = rows;
+    ctx->cols = 2;
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        ephem_body *b = &ctx->body[oid];
+        if (!bs[oid]) {
+            ctx->absent |= 1u << oid;
+            b->n = 2;
+            b->step = span / DE440_DAY;
+            b->nsub = 1;
+        } else {
+            if (span % bs[oid]->intlen != 0) {
+                ephem_error("spk: record span %zu is not a multiple of %zu",
+                    span, bs[oid]->intlen);
+            }
+            b->n = bs[oid]->n;
+            b->step = bs[oid]->intlen / DE440_DAY;
+            b->nsub = span / bs[oid]->intlen;
+            b->offset = b->nsub == 1 ? 0 : bs[oid]->rsize;
+            b->base = bs[oid]->begin + 2;
+            b->stride = b->nsub * bs[oid]->rsize;
+        }
+        ctx->cols += 3 * b->n * b->nsub;
+    }
+    if (ms && bs[ephem_id_Moon]) {
+        sp->minus[ephem_id_Moon] = ms->begin + 2;
+    }
+
+    sp->tbuf = malloc(2 * rows * sizeof(double));
+    if (!sp->tbuf) {
+        ephem_error("malloc: failed to allocate %zu bytes",
+            2 * rows * sizeof(double));
+    }
+    for (size_t row = 0; row < rows; row++) {
+        sp->tbuf[2 * row] = DE440_J2000 + (init + row * span) / DE440_DAY;
+        sp->tbuf[2 * row + 1] =
+            DE440_J2000 + (init + (row + 1) * span) / DE440_DAY;
+    }
+    ctx->PC = (double*)map;
+    ctx->PT = sp->tbuf;
+    ctx->tstride = 2;
+    ctx->jd_start = ctx->PT[0];
+    ctx->span = (double)span / DE440_DAY;
+    ctx->version = DE440_VERSION;
+    ctx->layout = ephem_layout_body;
+    ctx->format = ephem_format_f64;
+    ctx->spk = sp;
+}
+
+static int de440_cmp_seg(const void *a, const void *b)
+{
+    const ephem_daf_seg *x = a, *y = b;
+    double ex = x->init + (double)x->intlen * x->count;
+    double ey = y->init + (double)y->intlen * y->count;
+    return x->init != y->init ? (x->init > y->init) - (x->init < y->init) :
+        (ex > ey) - (ex < ey);
+}
+
+/*
+ * kernels whose segments split time into several ranges, such as DE441,
+ * get one context per range fronted by a chain.
+ */
+void de440_spk_ephem(ephem_ctx *ctx, const char *spk_bsp, int flags)
+{
+    struct stat st;
+    ephem_daf_seg *seg, *range;
+    size_t nseg, nrange = 0;
+    int fd, mflags = MAP_SHARED;
+    char *map;
+
+    fd = open(spk_bsp, O_RDONLY);
+    if (fd < 0) {
+        ephem_error("open: failed: %s", spk_bsp);
+    }
+    if (fstat(fd, &st) < 0) {
+        ephem_error("fstat: failed: %s", spk_bsp);
+    }
+#ifdef MAP_POPULATE
+    if (flags & ephem_map_populate) {
+        mflags |= MAP_POPULATE;
+    }
+#endif
+    map = mmap(NULL, st.st_size, PROT_READ, mflags, fd, 0);
+    if (map == MAP_FAILED) {
+        ephem_error("mmap: failed: %s", spk_bsp);
+    }
+    close(fd);
+#ifdef MADV_HUGEPAGE
+    if (flags & ephem_map_hugepage) {
+        madvise(map, st.st_size, MADV_HUGEPAGE);
+    }
+#endif
+
+    nseg = de440_daf_segs(map, st.st_size, &seg);
+    if (nseg == 0) {
+        ephem_error("spk: no type 2 or 3 segments: %s", spk_bsp);
+    }
+    range = de440_calloc(nseg, sizeof(ephem_daf_seg));
+    qsort(memcpy(range, seg, nseg * sizeof(ephem_daf_seg)), nseg,
+        sizeof(ephem_daf_seg), de440_cmp_seg);
+    for (size_t i = 0; i < nseg; i++) {
+        if (nrange == 0 || de440_cmp_seg(&range[nrange - 1], &range[i])) {
+            range[nrange++] = range[i];
+        }
+    }
+
+    if (nrange == 1) {
+        de440_spk_part(ctx, map, seg, nseg, range[0].init,
+            range[0].init + (double)range[0].intlen * range[0].count);
+        ctx->spk->map = map;
+        ctx->spk->map_size = st.st_size;
+    } else {
+        ephem_chain *ch = de440_chain_new(nrange);
+        for (size_t p = 0; p < nrange; p++) {
+            de440_spk_part(&ch->part[p], map, seg, nseg, range[p].init,
+                range[p].init + (double)range[p].intlen * range[p].count);
+        }
+        ch->part[0].spk->map = map;
+        ch->part[0].spk->map_size = st.st_size;
+        de440_chain_init(ctx, ch);
+    }
+    free(range);
+    free(seg);
+}
+
+void de440_destroy_ephem(ephem_ctx *ctx)
+{
+    if (ctx->pool) {
+        de440_pool_free(ctx->pool);
+        ctx->pool = NULL;
+    }
+    if (ctx->cache) {
+        free(ctx->cache->entry);
+        free(ctx->cache);
+        ctx->cache = NULL;
+    }
+    if (ctx->tail) {
+        free(ctx->tail->bound);
+        free(ctx->tail);
+        ctx->tail = NULL;
+    }
+    if (ctx->chain) {
+        ephem_chain *ch = ctx->chain;
+        for (size_t p = 0; p < ch->nparts; p++) {
+            de440_destroy_ephem(&ch->part[p]);
+        }
+        free(ch->part);
+        free(ch->base);
+        free(ch->seg);
+        free(ch->bucket);
+        free(ch);
+        return;
+    }
+    if (ctx->spk) {
+        ephem_spk *sp = ctx->spk;
+        if (sp->map) {
+            munmap(sp->map, sp->map_size);
+        }
+        free(sp->tbuf);
+        free(sp);
+        return;
+    }
+    if (ctx->pager) {
+        ephem_pager *pg = ctx->pager;
+        de440_pager_free(pg);
+        free(pg->index);
+        free(pg->tbuf);
+        if (pg->fd >= 0) {
+            close(pg->fd);
+        }
+        free(pg);
+    }
+    if (ctx->map_size) {
+        munmap(ctx->map, ctx->map_size);
+    } else if (!ctx->map) {
+        free(ctx->PC);
+    }
+}
+
+static void de440_fwrite(FILE *f, const void *buf, size_t size)
+{
+    size_t nbytes = fwrite(buf, 1, size, f);
+    if (nbytes != size) {
+        ephem_error("fwrite: invalid size: %zu != %zu", nbytes, size);
+    }
+}
+
+/*
+ * bound on the position error of keeping n coefficients of C in the given
+ * format. |T_k| <= 1 on the interval so the error of each axis is at most
+ * the sum of the dropped and rounded coefficient magnitudes.
+ */
+static double de440_trunc_error(const double *C, size_t m, size_t n,
+    size_t format)
+{
+    double e[3] = { 0, 0, 0 };
+
+    for (size_t c = 0; c < 3; c++) {
+        for (size_t k = 0; k < m; k++) {
+            double v = C[c * m + k];
+            if (k >= n) {
+                e[c] += fabs(v);
+            } else if (format == ephem_format_f32) {
+                e[c] += fabs(v - (double)(float)v);
+            }
+        }
+    }
+    return sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]) * 1e3;
+}
+
+static double de440_body_error(ephem_ctx *ctx, size_t oid, size_t n,
+    size_t format)
+{
+    double buf[3 * ephem_max_coeff], err = 0;
+    size_t nsub = ctx->body[oid].nsub, m = ctx->body[oid].n;
+
+    for (size_t row = 0; row < ctx->rows; row++) {
+        for (size_t sub = 0; sub < nsub; sub++) {
+            const double *C = de440_sub_coeff(ctx, row, oid, sub, buf);
+            double e = de440_trunc_error(C, m, n, format);
+            if (e > err) {
+                err = e;
+            }
+        }
+    }
+    return err + ctx->body[oid].err;
+}
+
+static float de440_round_up(double v)
+{
+    float f = (float)v;
+    return (double)f < v ? nextafterf(f, INFINITY) : f;
+}
+
+static inline int de440_angle_body(size_t oid)
+{
+    return oid == ephem_id_Nutations || oid == ephem_id_Librations;
+}
+
+void de440_tail_init(ephem_ctx *ctx)
+{
+    ephem_tail *tl, *old = NULL;
+    double buf[3 * ephem_max_coeff];
+    size_t size;
+
+    if (ctx->chain) {
+        for (size_t p = 0; p < ctx->chain->nparts; p++) {
+            de440_tail_init(&ctx->chain->part[p]);
+        }
+        return;
+    }
+    if (__atomic_load_n(&ctx->tail, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    tl = de440_calloc(1, sizeof(ephem_tail));
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        tl->base[oid] = tl->stride;
+        tl->stride += de440_angle_body(oid) ? 0 : ctx->body[oid].n + 1;
+    }
+    size = ctx->rows * tl->stride;
+    tl->bound = de440_calloc(size ? size : 1, sizeof(float));
+
+    for (size_t row = 0; row < ctx->rows; row++) {
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            const ephem_body *b = &ctx->body[oid];
+            float *t = tl->bound + row * tl->stride + tl->base[oid];
+            if (de440_angle_body(oid)) {
+                continue;
+            }
+            for (size_t sub = 0; sub < b->nsub; sub++) {
+                const double *C = de440_sub_coeff(ctx, row, oid, sub, buf);
+                double e[3] = { 0, 0, 0 };
+                for (size_t k = b->n; k-- > 0;) {
+                    float v;
+                    e[0] += fabs(C[k]);
+                    e[1] += fabs(C[b->n + k]);
+                    e[2] += fabs(C[2 * b->n + k]);
+                    v = de440_round_up(sqrt(e[0] * e[0] + e[1] * e[1] +
+                        e[2] * e[2]) * 1e3);
+                    t[k] = v > t[k] ? v : t[k];
+                }
+            }
+        }
+    }
+    if (!__atomic_compare_exchange_n(&ctx->tail, &old, tl, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(tl->bound);
+        free(tl);
+    }
+}
+
+/*
+ * fewest coefficients, at least two, whose tail bound plus the body's
+ * error bound is within tol in the record. all n for a tolerance of zero
+ * and for angles.
+ */
+static size_t de440_tail_select(ephem_ctx *ctx, size_t row, size_t oid,
+    double tol, double *bound)
+{
+    const ephem_body *b = &ctx->body[oid];
+    const ephem_tail *tl;
+    const float *t;
+    size_t k;
+
+    if (!(tol > 0) || de440_angle_body(oid)) {
+        *bound = b->err;
+        return b->n;
+    }
+    tl = __atomic_load_n(&ctx->tail, __ATOMIC_ACQUIRE);
+    if (!tl) {
+        de440_tail_init(ctx);
+        tl = __atomic_load_n(&ctx->tail, __ATOMIC_ACQUIRE);
+    }
+    t = tl->bound + tl->stride * row + tl->base[oid];
+    for (k = 2; k < b->n && !(t[k] + b->err <= tol); k++);
+    *bound = t[k] + b->err;
+    return k;
+}
+
+/*
+ * copy a body's coefficients for one record keeping n per component.
+ * untruncated bodies keep their sub-interval offset, which overlaps the
+ * next sub-interval for bodies with fewer than three components.
+ */
+static size_t de440_copy_body(ephem_ctx *ctx, size_t row, size_t oid,
+    size_t n, double *out)
+{
+    double buf[3 * ephem_max_coeff];
+    const ephem_body *b = &ctx->body[oid];
+    size_t offset = n == b->n && b->offset <= 3 * n ? b->offset : 3 * n;
+    size_t len = 0;
+
+    for (size_t sub = 0; sub < b->nsub; sub++) {
+        const double *C = de440_sub_coeff(ctx, row, oid, sub, buf);
+        size_t end = sub + 1 < b->nsub ? offset : 3 * n;
+        for (size_t k = 0; k < end; k++) {
+            out[len++] = n == b->n ? C[k] : C[k / n * b->n + k % n];
+        }
+    }
+    return len;
+}
+
+static void de440_write_vals(FILE *f, const double *v, size_t len,
+    size_t format)
+{
+    float vf[256];
+
+    if (format != ephem_format_f32) {
+        de440_fwrite(f, v, len * sizeof(double));
+        return;
+    }
+    for (size_t i = 0; i < len; i += 256) {
+        size_t m = len - i < 256 ? len - i : 256;
+        for (size_t k = 0; k < m; k++) {
+            vf[k] = (float)v[i + k];
+        }
+        de440_fwrite(f, vf, m * sizeof(float));
+    }
+}
+
+static void de440_write_pad(FILE *f, size_t len)
+{
+    static const char zero[DE440_ALIGN];
+    for (size_t i = 0; i < len; i += DE440_ALIGN) {
+        de440_fwrite(f, zero, len - i < DE440_ALIGN ? len - i : DE440_ALIGN);
+    }
+}
+
+static void de440_write_packed(FILE *f, ephem_ctx *ctx, size_t first,
+    size_t rows, const size_t *n, const ephem_hdr_layout *hl, size_t rec,
+    size_t block_rows)
+{
+    size_t nblocks = (rows + block_rows - 1) / block_rows;
+    size_t bound = de440_pack_bound(block_rows, rec);
+    uint64_t hdr[2] = { block_rows, nblocks }, *index;
+    double *w = malloc(block_rows * rec * sizeof(double));
+    uint8_t *z = malloc(bound), *scratch = malloc(bound);
+    long pos;
+
+    index = calloc(nblocks + 1, sizeof(uint64_t));
+    if (!w || !z || !scratch || !index) {
+        ephem_error("malloc: failed to allocate %zu bytes", 2 * bound);
+    }
+    de440_fwrite(f, hdr, sizeof(hdr));
+    pos = ftell(f);
+    de440_fwrite(f, index, (nblocks + 1) * sizeof(uint64_t));
+    for (size_t b = 0; b < nblocks; b++) {
+        size_t r0 = b * block_rows, nrec = rows - r0, len;
+        if (nrec > block_rows) {
+            nrec = block_rows;
+        }
+        memset(w, 0, nrec * rec * sizeof(double));
+        for (size_t row = r0; row < r0 + nrec; row++) {
+            for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+                de440_copy_body(ctx, first + row, oid, n[oid],
+                    w + (row - r0) * rec + hl[oid].base);
+            }
+        }
+        len = de440_pack_block((uint64_t*)w, nrec, rec, z, scratch);
+        de440_fwrite(f, z, len);
+        index[b + 1] = index[b] + len;
+    }
+    if (fseek(f, pos, SEEK_SET) != 0) {
+        ephem_error("fseek: failed at offset %ld", pos);
+    }
+    de440_fwrite(f, index, (nblocks + 1) * sizeof(uint64_t));
+    if (fseek(f, 0, SEEK_END) != 0) {
+        ephem_error("fseek: failed at offset %ld", pos);
+    }
+    free(index);
+    free(scratch);
+    free(z);
+    free(w);
+}
+
+static void de440_write_legacy(FILE *f, ephem_ctx *ctx, size_t first,
+    size_t rows)
+{
+    size_t dim[2] = { rows, ctx->cols };
+    double *rec = calloc(ctx->cols, sizeof(double));
+
+    if (!rec) {
+        ephem_error("calloc: failed to allocate %zu bytes",
+            ctx->cols * sizeof(double));
+    }
+    de440_fwrite(f, dim, sizeof(dim));
+    for (size_t row = first; row < first + rows; row++) {
+        memcpy(rec, de440_row_time(ctx, row), 2 * sizeof(double));
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            double *B = rec + ephem_idx[oid].start - 1;
+            size_t size = de440_body_size(ctx, oid);
+            if (ctx->pager) {
+                de440_page_copy(ctx, row, oid, 0, size, B);
+            } else {
+                memcpy(B, de440_row_body(ctx, row, oid),
+                    size * sizeof(double));
+            }
+        }
+        de440_fwrite(f, rec, ctx->cols * sizeof(double));
+    }
+    free(rec);
+}
+
+void de440_save_ephem(ephem_ctx *ctx, const char *ephem_bin,
+    const ephem_save_opts *opts)
+{
+    FILE *f;
+    ephem_hdr hdr;
+    ephem_hdr_layout hl[ephem_id_Last];
+    size_t n[ephem_id_Last], size[ephem_id_Last], lossy = 0;
+    size_t esize, align, base = 0, hsize, len, first = 0, rows = ctx->rows;
+    unsigned keep = (opts->mask ? opts->mask : ephem_mask_all) & ~ctx->absent;
+    double *rec;
+
+    if (ctx->chain) {
+        ephem_error("save: chained context: %s", ephem_bin);
+    }
+    if (opts->jd_start != 0) {
+        for (; rows > 0 && de440_row_time(ctx, first)[1] <= opts->jd_start;
+            first++, rows--);
+    }
+    if (opts->jd_end != 0) {
+        for (; rows > 0 &&
+            de440_row_time(ctx, first + rows - 1)[0] >= opts->jd_end; rows--);
+    }
+    if (rows == 0 && ctx->rows > 0) {
+        ephem_error("save: no records from %.1f to %.1f: %s",
+            opts->jd_start, opts->jd_end, ephem_bin);
+    }
+    if (opts->layout != ephem_layout_row && opts->layout != ephem_layout_body) {
+        ephem_error("save: unknown layout: %d", opts->layout);
+    }
+    if (opts->format != ephem_format_f64 && opts->format != ephem_format_f32 &&
+            opts->format != ephem_format_packed) {
+        ephem_error("save: unknown format: %d", opts->format);
+    }
+    if (opts->format == ephem_format_packed &&
+            opts->layout != ephem_layout_row) {
+        ephem_error("save: packed files are row-major: %d", opts->layout);
+    }
+    esize = de440_format_size(opts->format);
+    align = DE440_ALIGN / esize;
+
+    memset(hl, 0, sizeof(hl));
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        const ephem_body *b = &ctx->body[oid];
+        if (!(keep & (1u << oid))) {
+            /* bodies not kept are written with no coefficients */
+            n[oid] = 0;
+            size[oid] = 0;
+            hl[oid].step = b->step * b->nsub;
+            hl[oid].nsub = 1;
+            lossy = 1;
+            continue;
+        }
+        n[oid] = b->n;
+        if (opts->tolerance > 0) {
+            for (size_t k = 2; k < b->n; k++) {
+                if (de440_body_error(ctx, oid, k, opts->format) <=
+                        opts->tolerance) {
+                    n[oid] = k;
+                    break;
+                }
+            }
+        }
+        hl[oid].n = n[oid];
+        hl[oid].step = b->step;
+        hl[oid].nsub = b->nsub;
+        hl[oid].offset = b->nsub == 1 ? 0 :
+            n[oid] == b->n && b->offset <= 3 * n[oid] ? b->offset : 3 * n[oid];
+        hl[oid].err = de440_body_error(ctx, oid, n[oid], opts->format);
+        size[oid] = de440_align((b->nsub - 1) * hl[oid].offset +
+            3 * n[oid], align);
+        if (n[oid] != ephem_idx[oid].addend || b->step != ephem_idx[oid].step ||
+                hl[oid].offset != ephem_idx[oid].offset || hl[oid].err != 0 ||
+                opts->format != ephem_format_f64) {
+            lossy = 1;
+        }
+    }
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        hl[oid].base = base;
+        if (opts->layout == ephem_layout_row) {
+            base += size[oid];
+        } else {
+            hl[oid].stride = size[oid];
+            base += rows * size[oid];
+        }
+    }
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        if (opts->layout == ephem_layout_row) {
+            hl[oid].stride = base;
+        }
+    }
+
+    if (opts->legacy && (lossy || opts->layout != ephem_layout_row ||
+            ctx->span != DE440_FIXED_SPAN)) {
+        ephem_error("save: legacy files are untruncated DE440 doubles: %s",
+            ephem_bin);
+    }
+
+    f = fopen(ephem_bin, "w");
+    if (!f) {
+        ephem_error("fopen: failed: %s", ephem_bin);
+    }
+
+    if (opts->legacy) {
+        de440_write_legacy(f, ctx, first, rows);
+    } else {
+        hsize = de440_align(sizeof(hdr) + sizeof(hl), DE440_ALIGN);
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, ephem_magic, sizeof(ephem_magic));
+        hdr.version = DE440_VERSION;
+        hdr.layout = opts->layout;
+        hdr.rows = rows;
+        hdr.cols = ctx->cols;
+        hdr.format = opts->format;
+        hdr.nbody = ephem_id_Last;
+        hdr.byteorder = DE440_BYTEORDER;
+        hdr.hsize = hsize;
+        hdr.jd_start = rows ? de440_row_time(ctx, first)[0] : 0;
+        hdr.jd_end = rows ? de440_row_time(ctx, first + rows - 1)[1] : 0;
+        hdr.span = ctx->span;
+        hdr.recbytes = opts->layout == ephem_layout_row ? base * esize : 0;
+        hdr.tbytes = de440_align(rows * 2 * sizeof(double), DE440_ALIGN);
+        de440_fwrite(f, &hdr, sizeof(hdr));
+        de440_fwrite(f, hl, sizeof(hl));
+        de440_write_pad(f, hsize - sizeof(hdr) - sizeof(hl));
+        for (size_t row = first; row < first + rows; row++) {
+            de440_fwrite(f, de440_row_time(ctx, row), 2 * sizeof(double));
+        }
+        de440_write_pad(f, hdr.tbytes - rows * 2 * sizeof(double));
+
+        rec = malloc(ctx->cols * sizeof(double));
+        if (!rec) {
+            ephem_error("malloc: failed to allocate %zu bytes",
+                ctx->cols * sizeof(double));
+        }
+        if (opts->format == ephem_format_packed) {
+            de440_write_packed(f, ctx, first, rows, n, hl, base,
+                opts->block_rows ? opts->block_rows : 16);
+        } else if (opts->layout == ephem_layout_row) {
+            for (size_t row = first; row < first + rows; row++) {
+                for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+                    len = de440_copy_body(ctx, row, oid, n[oid], rec);
+                    de440_write_vals(f, rec, len, opts->format);
+                    de440_write_pad(f, (size[oid] - len) * esize);
+                }
+            }
+        } else {
+            for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+                for (size_t row = first; row < first + rows; row++) {
+                    len = de440_copy_body(ctx, row, oid, n[oid], rec);
+                    de440_write_vals(f, rec, len, opts->format);
+                    de440_write_pad(f, (size[oid] - len) * esize);
+                }
+            }
+        }
+        free(rec);
+    }
+
+    if (fclose(f) != 0) {
+        ephem_error("fclose: failed: %s", ephem_bin);
+    }
+}
+
+static void de440_cheb3d(double jd, size_t n, double jd0, double jd1,
+    const double* Cx, const double* Cy, const double* Cz,
+    double *r, float scale)
+{
+    double tau = 2*(jd - jd0)/(jd1 - jd0) - 1;
+
+    double Tx_prev = 1.0;
+    double Tx_curr = tau;
+    double sum_x = Cx[0] * Tx_prev + Cx[1] * Tx_curr;
+
+    double Ty_prev = 1.0;
+    double Ty_curr = tau;
+    double sum_y = Cy[0] * Ty_prev + Cy[1] * Ty_curr;
+
+    double Tz_prev = 1.0;
+    double Tz_curr = tau;
+    double sum_z = Cz[0] * Tz_prev + Cz[1] * Tz_curr;
+
+    for (size_t k = 2; k < n; ++k) {
+        double Tx_next = 2 * tau * Tx_curr - Tx_prev;
+        sum_x += Cx[k] * Tx_next;
+        Tx_prev = Tx_curr;
+        Tx_curr = Tx_next;
+
+        double Ty_next = 2 * tau * Ty_curr - Ty_prev;
+        sum_y += Cy[k] * Ty_next;
+        Ty_prev = Ty_curr;
+        Ty_curr = Ty_next;
+
+        double Tz_next = 2 * tau * Tz_curr - Tz_prev;
+        sum_z += Cz[k] * Tz_next;
+        Tz_prev = Tz_curr;
+        Tz_curr = Tz_next;
+    }
+
+    r[0] = sum_x * scale;
+    r[1] = sum_y * scale;
+    r[2] = sum_z * scale;
+}
+
+/*
+ * position, velocity and acceleration from one pass over the coefficients.
+ * dT_k = k U_{k-1} is carried by the recurrence dT_{k+1} = 2 T_k +
+ * 2 tau dT_k - dT_{k-1}, and likewise for the second derivative. the
+ * derivatives are scaled by dtau/djd = 2 / (jd1 - jd0) so velocity is per
+ * day and acceleration is per day squared. v and a may be NULL.
+ */
+static void de440_cheb3d_state(double jd, size_t n, double jd0, double jd1,
+    const double* Cx, const double* Cy, const double* Cz,
+    double *r, double *v, double *a, float scale)
+{
+    double tau = 2*(jd - jd0)/(jd1 - jd0) - 1;
+    double dtau = 2/(jd1 - jd0);
+
+    double T_prev = 1.0, T_curr = tau;
+    double dT_prev = 0.0, dT_curr = 1.0;
+    double d2T_prev = 0.0, d2T_curr = 0.0;
+
+    double sum_x = Cx[0] + Cx[1] * tau;
+    double sum_y = Cy[0] + Cy[1] * tau;
+    double sum_z = Cz[0] + Cz[1] * tau;
+    double dsum_x = Cx[1], dsum_y = Cy[1], dsum_z = Cz[1];
+    double d2sum_x = 0.0, d2sum_y = 0.0, d2sum_z = 0.0;
+
+    for (size_t k = 2; k < n; ++k) {
+        double T_next = 2 * tau * T_curr - T_prev;
+        double dT_next = 2 * T_curr + 2 * tau * dT_curr - dT_prev;
+        double d2T_next = 4 * dT_curr + 2 * tau * d2T_curr - d2T_prev;
+
+        sum_x += Cx[k] * T_next;
+        sum_y += Cy[k] * T_next;
+        sum_z += Cz[k] * T_next;
+        dsum_x += Cx[k] * dT_next;
+        dsum_y += Cy[k] * dT_next;
+        dsum_z += Cz[k] * dT_next;
+        d2sum_x += Cx[k] * d2T_next;
+        d2sum_y += Cy[k] * d2T_next;
+        d2sum_z += Cz[k] * d2T_next;
+
+        T_prev = T_curr; T_curr = T_next;
+        dT_prev = dT_curr; dT_curr = dT_next;
+        d2T_prev = d2T_curr; d2T_curr = d2T_next;
+    }
+
+    r[0] = sum_x * scale;
+    r[1] = sum_y * scale;
+    r[2] = sum_z * scale;
+    if (v) {
+        v[0] = dsum_x * dtau * scale;
+        v[1] = dsum_y * dtau * scale;
+        v[2] = dsum_z * dtau * scale;
+    }
+    if (a) {
+        a[0] = d2sum_x * dtau * dtau * scale;
+        a[1] = d2sum_y * dtau * dtau * scale;
+        a[2] = d2sum_z * dtau * dtau * scale;
+    }
+}
+
+static size_t de440_interval(double dt, size_t step, size_t n)
+{
+    size_t i;
+    if (!(dt > 0)) {
+        return 0;
+    }
+    i = (size_t)(dt / step);
+    return i < n ? i : n - 1;
+}
+
+static void de440_body_coeff(ephem_ctx *ctx, double jd, size_t row,
+    size_t oid, double *jd0, const double **C, double *buf)
+{
+    const ephem_body *body = &ctx->body[oid];
+    size_t n = ctx->body[oid].n;
+    const double *B;
+    double t1;
+    size_t i;
+
+    t1 = de440_row_time(ctx, row)[0];
+    i = de440_interval(jd - t1, body->step, body->nsub);
+    B = de440_sub_coeff(ctx, row, oid, i, buf);
+    *jd0 = t1 + body->step * i;
+    C[0] = B;
+    C[1] = B + n;
+    C[2] = B + n * 2;
+}
+
+static void de440_ephem_body(ephem_ctx *ctx, double jd, size_t row,
+    size_t oid, double *r)
+{
+    const ephem_body *body = &ctx->body[oid];
+    const double *C[3];
+    double buf[3 * ephem_max_coeff];
+    double rec[DE440_FIXED_BODY];
+    double jd0, s = 1e3;
+
+    if (ctx->fixed && ctx->pager) {
+        de440_page_copy(ctx, row, oid, 0, de440_body_size(ctx, oid), rec);
+        ephem_kern[oid](rec, jd - de440_row_time(ctx, row)[0], r, s);
+        return;
+    } else if (ctx->fixed) {
+        ephem_kern[oid](de440_row_body(ctx, row, oid),
+            jd - de440_row_time(ctx, row)[0], r, s);
+        return;
+    }
+
+    de440_body_coeff(ctx, jd, row, oid, &jd0, C, buf);
+    de440_cheb3d(jd, ctx->body[oid].n, jd0, jd0 + body->step,
+        C[0], C[1], C[2], r, s);
+}
+
+static void de440_ephem_body_state(ephem_ctx *ctx, double jd, size_t row,
+    size_t oid, double *r, double *v, double *a)
+{
+    const ephem_body *body = &ctx->body[oid];
+    const double *C[3];
+    double buf[3 * ephem_max_coeff];
+    double jd0, s = 1e3;
+
+    de440_body_coeff(ctx, jd, row, oid, &jd0, C, buf);
+    de440_cheb3d_state(jd, ctx->body[oid].n, jd0, jd0 + body->step,
+        C[0], C[1], C[2], r, v, a, s);
+}
+
+static inline int de440_cmp(ephem_ctx *ctx, double jd, size_t row)
+{
+    const double *d = de440_row_time(ctx, row);
+    double jd1 = d[0], jd2 = d[1];
+    if (jd < jd1) return -1;
+    else if (jd > jd2) return 1;
+    else return 0;
+}
+
+static size_t de440_search_row(ephem_ctx *ctx, double jd,
+    size_t begin, size_t end)
+{
+    end -= begin;
+    while (end != 0) {
+        size_t half = (end >> 1), probe = begin + half;
+        if (de440_cmp(ctx, jd, probe) > 0) {
+            begin = probe + 1;
+            end -= half + 1;
+        } else {
+            end = half;
+        }
+    }
+    if (begin < ctx->rows && de440_cmp(ctx, jd, begin) == 0) {
+        /* on a boundary, the later record */
+        if (begin + 1 < ctx->rows && de440_cmp(ctx, jd, begin + 1) == 0) {
+            begin++;
+        }
+        return begin;
+    }
+    return -1;
+}
+
+/*
+ * exponential search outwards from a known row, for sweeps that move
+ * monotonically through time. touches O(log d) rows for a distance d.
+ */
+static size_t de440_gallop_row(ephem_ctx *ctx, double jd, size_t hint)
+{
+    size_t lo, hi, step = 1;
+    int cmp;
+
+    if (hint >= ctx->rows) {
+        return de440_find_row(ctx, jd);
+    }
+    cmp = de440_cmp(ctx, jd, hint);
+    if (cmp > 0) {
+        lo = hi = hint + 1;
+        while (hi < ctx->rows && de440_cmp(ctx, jd, hi) > 0) {
+            lo = hi + 1;
+            hi = hint + (step <<= 1);
+        }
+        return de440_search_row(ctx, jd, lo,
+            hi < ctx->rows ? hi + 1 : ctx->rows);
+    } else if (cmp < 0) {
+        lo = hi = hint;
+        while (lo > 0 && de440_cmp(ctx, jd, lo - 1) < 0) {
+            hi = lo - 1;
+            lo = hint > step ? hint - step : 0;
+            step <<= 1;
+        }
+        return de440_search_row(ctx, jd, lo > 0 ? lo - 1 : 0, hi);
+    }
+    return de440_search_row(ctx, jd, hint, hint + 1);
+}
+
+/*
+ * records cover a fixed span from a known epoch so the row is computed
+ * directly and checked against the record bounds. files with irregular
+ * records fall back to binary search. a date on the boundary between two
+ * records finds the later one, records being taken as [start, end) like
+ * the groups of the batch, query and cursor paths; the original lookup
+ * found the earlier one.
+ */
+size_t de440_find_row(ephem_ctx *ctx, double jd)
+{
+    double r;
+
+    if (ctx->chain) {
+        size_t base = 0, row;
+        ephem_ctx *part = de440_chain_find(ctx, jd, &base);
+        row = part ? de440_find_row(part, jd) : -1;
+        return row == -1 ? -1 : base + row;
+    }
+    r = floor((jd - ctx->jd_start) / ctx->span);
+    if (r >= 0 && r < ctx->rows) {
+        size_t row = (size_t)r;
+        int cmp = de440_cmp(ctx, jd, row);
+        if (cmp == 0) {
+            return row;
+        } else if (cmp < 0 && row > 0 && de440_cmp(ctx, jd, row - 1) == 0) {
+            return row - 1;
+        } else if (cmp > 0 && row + 1 < ctx->rows &&
+                de440_cmp(ctx, jd, row + 1) == 0) {
+            return row + 1;
+        }
+    }
+    return de440_search_row(ctx, jd, 0, ctx->rows);
+}
+
+void de440_cache_init(ephem_ctx *ctx, size_t entries)
+{
+    ephem_cache *c;
+    size_t n = DE440_CACHE_PROBE;
+
+    if (ctx->cache) {
+        ephem_error("cache: already enabled: %zu", entries);
+    }
+    while (n < entries) {
+        n <<= 1;
+    }
+    c = de440_alloc(sizeof(ephem_cache));
+    c->entry = de440_calloc(n, sizeof(ephem_entry));
+    c->mask = n - 1;
+    for (size_t i = 0; i < n; i++) {
+        atomic_init(&c->entry[i].seq, 0);
+        atomic_init(&c->entry[i].tag, 0);
+    }
+    for (size_t i = 0; i < DE440_CACHE_STRIPES; i++) {
+        atomic_init(&c->stripe[i].hits, 0);
+        atomic_init(&c->stripe[i].misses, 0);
+    }
+    ctx->cache = c;
+}
+
+void de440_cache_stats(ephem_ctx *ctx, size_t *hits, size_t *misses)
+{
+    ephem_cache *c = ctx->cache;
+
+    *hits = 0;
+    *misses = 0;
+    for (size_t i = 0; c && i < DE440_CACHE_STRIPES; i++) {
+        *hits += atomic_load_explicit(&c->stripe[i].hits,
+            memory_order_relaxed);
+        *misses += atomic_load_explicit(&c->stripe[i].misses,
+            memory_order_relaxed);
+    }
+}
+
+static void de440_cache_count(atomic_size_t *n)
+{
+    atomic_fetch_add_explicit(n, 1, memory_order_relaxed);
+}
+
+/* tags hold the record, the output kind and the body; zero is empty */
+static uint64_t de440_cache_tag(size_t row, size_t oid, size_t kind)
+{
+    return ((uint64_t)row << 16) | (kind << 8) | (oid + 1);
+}
+
+static size_t de440_cache_hash(uint64_t bits, uint64_t tag)
+{
+    uint64_t h = (bits ^ (tag * 0x9e3779b97f4a7c15ull)) *
+        0xff51afd7ed558ccdull;
+    return (size_t)(h ^ (h >> 32));
+}
+
+static int de440_cache_get(ephem_cache *c, double jd, uint64_t tag,
+    double *v, size_t n)
+{
+    uint64_t bits, w[9];
+    size_t h;
+
+    memcpy(&bits, &jd, sizeof(bits));
+    h = de440_cache_hash(bits, tag);
+    for (size_t i = 0; i < DE440_CACHE_PROBE; i++) {
+        ephem_entry *e = &c->entry[(h + i) & c->mask];
+        uint64_t s = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (s & 1 ||
+            atomic_load_explicit(&e->tag, memory_order_relaxed) != tag ||
+            atomic_load_explicit(&e->jd, memory_order_relaxed) != bits) {
+            continue;
+        }
+        for (size_t k = 0; k < n; k++) {
+            w[k] = atomic_load_explicit(&e->v[k], memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) != s) {
+            break;
+        }
+        memcpy(v, w, n * sizeof(double));
+        de440_cache_count(&c->stripe[h % DE440_CACHE_STRIPES].hits);
+        return 1;
+    }
+    de440_cache_count(&c->stripe[h % DE440_CACHE_STRIPES].misses);
+    return 0;
+}
+
+static void de440_cache_put(ephem_cache *c, double jd, uint64_t tag,
+    const double *v, size_t n)
+{
+    uint64_t bits, w[9], s;
+    ephem_entry *e = NULL;
+    size_t h;
+
+    memcpy(&bits, &jd, sizeof(bits));
+    memcpy(w, v, n * sizeof(double));
+    h = de440_cache_hash(bits, tag);
+
+    /* the first empty entry in the window, else the home entry */
+    for (size_t i = 0; i < DE440_CACHE_PROBE && !e; i++) {
+        ephem_entry *f = &c->entry[(h + i) & c->mask];
+        if (atomic_load_explicit(&f->tag, memory_order_relaxed) == 0) {
+            e = f;
+        }
+    }
+    if (!e) {
+        e = &c->entry[h & c->mask];
+    }
+    s = atomic_load_explicit(&e->seq, memory_order_relaxed);
+    if (s & 1 || !atomic_compare_exchange_strong_explicit(&e->seq, &s,
+            s + 1, memory_order_acquire, memory_order_relaxed)) {
+        return;
+    }
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&e->tag, tag, memory_order_relaxed);
+    atomic_store_explicit(&e->jd, bits, memory_order_relaxed);
+    for (size_t k = 0; k < n; k++) {
+        atomic_store_explicit(&e->v[k], w[k], memory_order_relaxed);
+    }
+    atomic_store_explicit(&e->seq, s + 2, memory_order_release);
+}
+
+void de440_ephem_obj(ephem_ctx *ctx, double jd, size_t row, size_t oid, 
+    double *obj)
+{
+    ephem_cache *c = row == -1 ? NULL : ctx->cache;
+    uint64_t tag = de440_cache_tag(row, oid, 0);
+
+    if (c && de440_cache_get(c, jd, tag, obj, 3)) {
+        return;
+    }
+    if (row == -1) {
+        obj[0] = NAN; obj[1] = NAN; obj[2] = NAN;
+    } else if (ctx->chain) {
+        ephem_ctx *part = de440_chain_row(ctx, &row);
+        de440_ephem_body(part, jd, row, oid, obj);
+    } else {
+        de440_ephem_body(ctx, jd, row, oid, obj);
+    }
+    if (c) {
+        de440_cache_put(c, jd, tag, obj, 3);
+    }
+}
+
+double de440_ephem_obj_tol(ephem_ctx *ctx, double jd, size_t row,
+    size_t oid, double tol, double *obj)
+{
+    const double *C[3];
+    double buf[3 * ephem_max_coeff];
+    double jd0, bound;
+    size_t k;
+
+    if (row == -1) {
+        obj[0] = NAN; obj[1] = NAN; obj[2] = NAN;
+        return NAN;
+    }
+    if (ctx->chain) {
+        ctx = de440_chain_row(ctx, &row);
+    }
+    k = de440_tail_select(ctx, row, oid, tol, &bound);
+    if (k == ctx->body[oid].n) {
+        de440_ephem_body(ctx, jd, row, oid, obj);
+    } else {
+        de440_body_coeff(ctx, jd, row, oid, &jd0, C, buf);
+        de440_cheb3d(jd, k, jd0, jd0 + ctx->body[oid].step,
+            C[0], C[1], C[2], obj, 1e3);
+    }
+    return bound;
+}
+
+void de440_ephem_state(ephem_ctx *ctx, double jd, size_t oid,
+    double *pos, double *vel, double *acc)
+{
+    size_t row = de440_find_row(ctx, jd);
+    ephem_cache *c = row == -1 ? NULL : ctx->cache;
+    uint64_t tag = de440_cache_tag(row, oid, 1 + !!vel + 2 * !!acc);
+    double v[9];
+
+    if (c && de440_cache_get(c, jd, tag, v, 9)) {
+        memcpy(pos, v, 3 * sizeof(double));
+        if (vel) { memcpy(vel, v + 3, 3 * sizeof(double)); }
+        if (acc) { memcpy(acc, v + 6, 3 * sizeof(double)); }
+        return;
+    }
+    if (row != -1 && ctx->chain) {
+        ctx = de440_chain_row(ctx, &row);
+    }
+    if (row == -1) {
+        pos[0] = NAN; pos[1] = NAN; pos[2] = NAN;
+        if (vel) { vel[0] = NAN; vel[1] = NAN; vel[2] = NAN; }
+        if (acc) { acc[0] = NAN; acc[1] = NAN; acc[2] = NAN; }
+    } else {
+        de440_ephem_body_state(ctx, jd, row, oid, pos, vel, acc);
+    }
+    if (c) {
+        memcpy(v, pos, 3 * sizeof(double));
+        memcpy(v + 3, vel ? vel : pos, 3 * sizeof(double));
+        memcpy(v + 6, acc ? acc : pos, 3 * sizeof(double));
+        de440_cache_put(c, jd, tag, v, 9);
+    }
+}
+
+void de440_ephem_batch(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double *xyz_out)
+{
+    de440_ephem_batch_strided(ctx, oid, jd, n,
+        xyz_out, xyz_out + 1, xyz_out + 2, 3);
+}
+
+static double de440_batch(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double *x, double *y, double *z, size_t stride, double tol,
+    int f32);
+
+/* runs of dates served by one file go to that file's batch */
+static double de440_chain_batch(ephem_ctx *ctx, size_t oid,
+    const double *jd, size_t n, double *x, double *y, double *z,
+    size_t stride, double tol, int f32)
+{
+    ephem_chain *ch = ctx->chain;
+    double bound = 0, b;
+    size_t i, m;
+
+    for (size_t k = 0; k < n; k += m) {
+        i = de440_chain_seg(ch, jd[k]);
+        for (m = 1; k + m < n && de440_chain_seg(ch, jd[k + m]) == i; m++);
+        if (i == -1) {
+            for (size_t j = k; j < k + m; j++) {
+                x[j * stride] = NAN; y[j * stride] = NAN; z[j * stride] = NAN;
+            }
+        } else {
+            b = de440_batch(&ch->part[ch->seg[i].part], oid, jd + k, m,
+                x + k * stride, y + k * stride, z + k * stride, stride, tol,
+                f32);
+            bound = b > bound ? b : bound;
+        }
+    }
+    return bound;
+}
+
+/*
+ * evaluates a batch keeping, in each record, the fewest coefficients
+ * whose tail bound is within tol, all of them for a tolerance of zero.
+ * f32 selects the float32 kernels where the ISA has them, adding their
+ * rounding bound to the tail bound. returns the largest bound used.
+ */
+static double de440_batch(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double *x, double *y, double *z, size_t stride, double tol,
+    int f32)
+{
+    const ephem_body *body = &ctx->body[oid];
+    de440_cheb3d_batch_fn cheb3d = f32 ? de440_cheb3d_batch_f32() : NULL;
+    const double *C;
+    double buf[3 * ephem_max_coeff];
+    double t1 = 0, t2 = -1, s = 1e3, bound = 0, b = 0, e;
+    size_t row = 0, i, m, nc = ctx->body[oid].n, k1 = nc;
+
+    if (ctx->chain) {
+        return de440_chain_batch(ctx, oid, jd, n, x, y, z, stride, tol, f32);
+    }
+    if (!cheb3d) {
+        cheb3d = de440_cheb3d_batch();
+        f32 = 0;
+    }
+    for (size_t k = 0; k < n; k += m) {
+        double t = jd[k];
+        if (!(t >= t1 && t < t2)) {
+            row = de440_find_row(ctx, t);
+            if (row == -1) {
+                x[k * stride] = NAN; y[k * stride] = NAN; z[k * stride] = NAN;
+                t1 = 0; t2 = -1; m = 1;
+                continue;
+            }
+            t1 = de440_row_time(ctx, row)[0];
+            t2 = de440_row_time(ctx, row)[1];
+            k1 = de440_tail_select(ctx, row, oid, tol, &b);
+            bound = b > bound ? b : bound;
+        }
+        i = de440_interval(t - t1, body->step, body->nsub);
+        for (m = 1; k + m < n; m++) {
+            t = jd[k + m];
+            if (!(t >= t1 && t < t2) ||
+                    de440_interval(t - t1, body->step, body->nsub) != i) {
+                break;
+            }
+        }
+        C = de440_sub_coeff(ctx, row, oid, i, buf);
+        cheb3d(m, jd + k, t1 + body->step * i, body->step, k1,
+            C, C + nc, C + nc * 2, s,
+            x + k * stride, y + k * stride, z + k * stride, stride);
+        if (f32) {
+            e = b + de440_cheb3d_f32_bound(k1, C, C + nc, C + nc * 2, s);
+            bound = e > bound ? e : bound;
+        }
+    }
+    return bound;
+}
+
+void de440_ephem_batch_strided(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double *x, double *y, double *z, size_t stride)
+{
+    de440_batch(ctx, oid, jd, n, x, y, z, stride, 0, 0);
+}
+
+double de440_ephem_batch_tol(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double tol, double *xyz_out)
+{
+    return de440_batch(ctx, oid, jd, n, xyz_out, xyz_out + 1, xyz_out + 2, 3,
+        tol, 0);
+}
+
+/*
+ * display-grade batches run the recurrence in float32 at twice the lanes.
+ * the bound returned, in metres, covers the rounding as well as the tail.
+ * the rounding scales with the motion over a sub-interval: for DE440 the
+ * bound is near 400 km for Mercury and the Earth-Moon barycenter, 140 km
+ * for Jupiter and 4 km for the Moon, errors in sweeps staying under a
+ * tenth of it. without AVX2 the double kernels run and the bound returned
+ * is the tail bound alone.
+ */
+double de440_ephem_batch_f32(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double tol, double *xyz_out)
+{
+    return de440_batch(ctx, oid, jd, n, xyz_out, xyz_out + 1, xyz_out + 2, 3,
+        tol, 1);
+}
+
+/*
+ * parallel batches run on a pool of threads that the first one starts and
+ * that lives with the context. a batch is cut into chunks of
+ * DE440_PARALLEL_GRAIN dates that workers take in turn from a shared
+ * counter. the batch kernels give a date the same result wherever it
+ * falls in a group, so a chunk may cut through the dates of one record
+ * and the output is still bitwise the same for any thread count, dense
+ * batches in a few records spreading over all workers. each worker keeps
+ * its own view of paged parts for the life of the pool, so threads don't
+ * contend on the page cache lock. batches on one context take the pool
+ * in turn.
+ */
+struct ephem_job
+{
+    ephem_ctx *ctx;
+    size_t oid;
+    const double *jd;
+    size_t n;
+    double *out;
+    size_t nchunks;
+    size_t nthreads;
+    atomic_size_t next;
+};
+
+struct ephem_worker
+{
+    ephem_pool *pool;
+    ephem_ctx *view;
+    size_t id;
+    unsigned long gen;
+    pthread_t thread;
+};
+
+struct ephem_pool
+{
+    pthread_mutex_t call;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    ephem_worker **worker;
+    size_t nworkers;
+    size_t nparts;
+    size_t busy;
+    unsigned long gen;
+    int quit;
+    ephem_job job;
+};
+
+static pthread_mutex_t de440_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* evaluates dates k to k + m, through the views of paged parts if any */
+static void de440_pool_run(ephem_job *jb, ephem_ctx *view, size_t k,
+    size_t m)
+{
+    ephem_ctx *ctx = jb->ctx;
+    ephem_chain *ch = ctx->chain;
+    double *o = jb->out + 3 * k;
+    size_t i, p = 0, r;
+
+    for (; m > 0; k += r, m -= r, o += 3 * r) {
+        r = m;
+        if (ch) {
+            i = de440_chain_seg(ch, jb->jd[k]);
+            for (r = 1; r < m && de440_chain_seg(ch, jb->jd[k + r]) == i;
+                r++);
+            if (i == -1) {
+                for (size_t j = 0; j < 3 * r; j++) {
+                    o[j] = NAN;
+                }
+                continue;
+            }
+            p = ch->seg[i].part;
+            ctx = &ch->part[p];
+        }
+        de440_batch(view && view[p].pager ? &view[p] : ctx, jb->oid,
+            jb->jd + k, r, o, o + 1, o + 2, 3, 0, 0);
+    }
+}
+
+static void de440_pool_work(ephem_job *jb, ephem_ctx *view)
+{
+    size_t g = DE440_PARALLEL_GRAIN, c, k;
+
+    while ((c = atomic_fetch_add(&jb->next, 1)) < jb->nchunks) {
+        k = c * g;
+        de440_pool_run(jb, view, k, k + g < jb->n ? g : jb->n - k);
+    }
+}
+
+static void* de440_pool_thread(void *arg)
+{
+    ephem_worker *w = arg;
+    ephem_pool *pl = w->pool;
+    ephem_ctx *ctx;
+    ephem_pager *pg;
+
+    pthread_mutex_lock(&pl->lock);
+    for (;;) {
+        while (!pl->quit && w->gen == pl->gen) {
+            pthread_cond_wait(&pl->wake, &pl->lock);
+        }
+        if (pl->quit) {
+            break;
+        }
+        w->gen = pl->gen;
+        if (w->id >= pl->job.nthreads) {
+            continue;
+        }
+        pthread_mutex_unlock(&pl->lock);
+
+        /* the views follow the context, keeping their own pages */
+        ctx = pl->job.ctx;
+        for (size_t p = 0; p < pl->nparts; p++) {
+            if ((pg = w->view[p].pager)) {
+                w->view[p] = ctx->chain ? ctx->chain->part[p] : *ctx;
+                w->view[p].pager = pg;
+            }
+        }
+        de440_pool_work(&pl->job, w->view);
+
+        pthread_mutex_lock(&pl->lock);
+        if (--pl->busy == 0) {
+            pthread_cond_signal(&pl->done);
+        }
+    }
+    pthread_mutex_unlock(&pl->lock);
+    return NULL;
+}
+
+static ephem_pool* de440_pool_new(ephem_ctx *ctx)
+{
+    ephem_pool *pl = de440_calloc(1, sizeof(ephem_pool));
+
+    pthread_mutex_init(&pl->call, NULL);
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->wake, NULL);
+    pthread_cond_init(&pl->done, NULL);
+    pl->nparts = ctx->chain ? ctx->chain->nparts : 1;
+    return pl;
+}
+
+/* starts workers up to n besides the calling thread, which is worker 0 */
+static void de440_pool_grow(ephem_pool *pl, ephem_ctx *ctx, size_t n)
+{
+    ephem_worker *w;
+
+    if (n <= pl->nworkers) {
+        return;
+    }
+    pl->worker = realloc(pl->worker, n * sizeof(ephem_worker*));
+    if (!pl->worker) {
+        ephem_error("realloc: failed to allocate %zu workers", n);
+    }
+    for (size_t t = pl->nworkers; t < n; t++) {
+        w = de440_calloc(1, sizeof(ephem_worker));
+        w->pool = pl;
+        w->id = t + 1;
+        w->gen = pl->gen;
+        w->view = de440_calloc(pl->nparts, sizeof(ephem_ctx));
+        for (size_t p = 0; p < pl->nparts; p++) {
+            ephem_ctx *part = ctx->chain ? &ctx->chain->part[p] : ctx;
+            if (part->pager) {
+                w->view[p].pager = de440_pager_view(part->pager);
+            }
+        }
+        if (pthread_create(&w->thread, NULL, de440_pool_thread, w)) {
+            ephem_error("pthread_create: failed: %zu", t + 1);
+        }
+        pl->worker[pl->nworkers++] = w;
+    }
+}
+
+static void de440_pool_free(ephem_pool *pl)
+{
+    pthread_mutex_lock(&pl->lock);
+    pl->quit = 1;
+    pthread_cond_broadcast(&pl->wake);
+    pthread_mutex_unlock(&pl->lock);
+    for (size_t t = 0; t < pl->nworkers; t++) {
+        ephem_worker *w = pl->worker[t];
+        pthread_join(w->thread, NULL);
+        for (size_t p = 0; p < pl->nparts; p++) {
+            if (w->view[p].pager) {
+                de440_pager_free(w->view[p].pager);
+                free(w->view[p].pager);
+            }
+        }
+        free(w->view);
+        free(w);
+    }
+    free(pl->worker);
+    pthread_mutex_destroy(&pl->call);
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->wake);
+    pthread_cond_destroy(&pl->done);
+    free(pl);
+}
+
+void de440_ephem_batch_parallel(ephem_ctx *ctx, size_t oid, const double *jd,
+    size_t n, double *xyz_out, size_t nthreads)
+{
+    size_t nchunks = (n + DE440_PARALLEL_GRAIN - 1) / DE440_PARALLEL_GRAIN;
+    ephem_pool *pl;
+    ephem_job *jb;
+
+    if (nthreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? ncpu : 1;
+    }
+    if (nthreads > nchunks) {
+        nthreads = nchunks;
+    }
+    if (nthreads <= 1) {
+        de440_ephem_batch(ctx, oid, jd, n, xyz_out);
+        return;
+    }
+
+    pthread_mutex_lock(&de440_pool_lock);
+    if (!ctx->pool) {
+        ctx->pool = de440_pool_new(ctx);
+    }
+    pl = ctx->pool;
+    pthread_mutex_unlock(&de440_pool_lock);
+
+    pthread_mutex_lock(&pl->call);
+    de440_pool_grow(pl, ctx, nthreads - 1);
+    pthread_mutex_lock(&pl->lock);
+    jb = &pl->job;
+    jb->ctx = ctx;
+    jb->oid = oid;
+    jb->jd = jd;
+    jb->n = n;
+    jb->out = xyz_out;
+    jb->nchunks = nchunks;
+    jb->nthreads = nthreads;
+    atomic_init(&jb->next, 0);
+    pl->busy = nthreads - 1;
+    pl->gen++;
+    pthread_cond_broadcast(&pl->wake);
+    pthread_mutex_unlock(&pl->lock);
+
+    /* the calling thread works too, on the context itself */
+    de440_pool_work(jb, NULL);
+    pthread_mutex_lock(&pl->lock);
+    while (pl->busy) {
+        pthread_cond_wait(&pl->done, &pl->lock);
+    }
+    pthread_mutex_unlock(&pl->lock);
+    pthread_mutex_unlock(&pl->call);
+}
+
+/*
+ * query batches take dates for any mix of bodies in any order. queries
+ * are keyed by record and by body and sub-interval, and two passes of a
+ * counting sort bring together the queries that share coefficients, in
+ * record order. each group is one batch kernel call over a hot row and
+ * the results are scattered back to the order given.
+ */
+struct ephem_query
+{
+    size_t row;
+    uint32_t key;
+    uint32_t pad;
+    size_t idx;
+    double jd;
+};
+
+static void de440_query_sort(const ephem_query *in, ephem_query *out,
+    size_t n, size_t nkey, int by_row)
+{
+    size_t *cnt = de440_calloc(nkey + 1, sizeof(size_t));
+
+    for (size_t i = 0; i < n; i++) {
+        cnt[(by_row ? in[i].row : in[i].key) + 1]++;
+    }
+    for (size_t k = 0; k < nkey; k++) {
+        cnt[k + 1] += cnt[k];
+    }
+    for (size_t i = 0; i < n; i++) {
+        out[cnt[by_row ? in[i].row : in[i].key]++] = in[i];
+    }
+    free(cnt);
+}
+
+void de440_ephem_query(ephem_ctx *ctx, const double *jd, const size_t *oid,
+    size_t n, double *xyz_out)
+{
+    de440_cheb3d_batch_fn cheb3d = de440_cheb3d_batch();
+    size_t nparts = ctx->chain ? ctx->chain->nparts : 1, maxsub = 1;
+    ephem_query *q, *t;
+    double *sj, *so;
+    double buf[3 * ephem_max_coeff];
+
+    for (size_t p = 0; p < nparts; p++) {
+        ephem_ctx *part = ctx->chain ? &ctx->chain->part[p] : ctx;
+        for (size_t o = 0; o < ephem_id_Last; o++) {
+            if (part->body[o].nsub > maxsub) {
+                maxsub = part->body[o].nsub;
+            }
+        }
+    }
+
+    /* dates outside the file go in a last bucket after every row */
+    q = de440_calloc(n ? n : 1, sizeof(ephem_query));
+    t = de440_calloc(n ? n : 1, sizeof(ephem_query));
+    for (size_t i = 0; i < n; i++) {
+        size_t r = de440_find_row(ctx, jd[i]), local = r;
+        ephem_ctx *part = ctx;
+        const ephem_body *b;
+        t[i].idx = i;
+        t[i].jd = jd[i];
+        if (r == -1) {
+            t[i].row = ctx->rows;
+            continue;
+        }
+        if (ctx->chain) {
+            part = de440_chain_row(ctx, &local);
+        }
+        b = &part->body[oid[i]];
+        t[i].row = r;
+        t[i].key = (uint32_t)(oid[i] * maxsub + de440_interval(
+            jd[i] - de440_row_time(part, local)[0], b->step, b->nsub));
+    }
+    de440_query_sort(t, q, n, ephem_id_Last * maxsub, 0);
+    de440_query_sort(q, t, n, ctx->rows + 1, 1);
+
+    sj = de440_calloc(n ? n : 1, sizeof(double));
+    so = de440_calloc(3 * (n ? n : 1), sizeof(double));
+    for (size_t i = 0; i < n; i++) {
+        sj[i] = t[i].jd;
+    }
+    for (size_t i = 0, m; i < n; i += m) {
+        size_t r = t[i].row, local = r, o = t[i].key / maxsub;
+        size_t sub = t[i].key % maxsub;
+        ephem_ctx *part = ctx;
+        const ephem_body *b;
+        const double *C;
+        for (m = 1; i + m < n && t[i + m].row == r &&
+            t[i + m].key == t[i].key; m++);
+        if (r == ctx->rows) {
+            for (size_t j = 3 * i; j < 3 * (i + m); j++) {
+                so[j] = NAN;
+            }
+            continue;
+        }
+        if (ctx->chain) {
+            part = de440_chain_row(ctx, &local);
+        }
+        b = &part->body[o];
+        C = de440_sub_coeff(part, local, o, sub, buf);
+        cheb3d(m, sj + i, de440_row_time(part, local)[0] + b->step * sub,
+            b->step, b->n, C, C + b->n, C + b->n * 2, 1e3,
+            so + 3 * i, so + 3 * i + 1, so + 3 * i + 2, 3);
+    }
+    for (size_t i = 0; i < n; i++) {
+        memcpy(xyz_out + 3 * t[i].idx, so + 3 * i, 3 * sizeof(double));
+    }
+    free(so);
+    free(sj);
+    free(t);
+    free(q);
+}
+
+static void de440_cheb_basis(double *T, size_t k0, size_t n)
+{
+    for (size_t k = k0; k < n; k++) {
+        T[k] = 2 * T[1] * T[k - 1] - T[k - 2];
+    }
+}
+
+static void de440_cheb_dot(const double *Cx, const double *T, size_t n,
+    double *r, double scale)
+{
+    const double *Cy = Cx + n, *Cz = Cy + n;
+    double sum_x = Cx[0] * T[0] + Cx[1] * T[1];
+    double sum_y = Cy[0] * T[0] + Cy[1] * T[1];
+    double sum_z = Cz[0] * T[0] + Cz[1] * T[1];
+
+    for (size_t k = 2; k < n; k++) {
+        sum_x += Cx[k] * T[k];
+        sum_y += Cy[k] * T[k];
+        sum_z += Cz[k] * T[k];
+    }
+
+    r[0] = sum_x * scale;
+    r[1] = sum_y * scale;
+    r[2] = sum_z * scale;
+}
+
+void de440_cursor_init(ephem_cursor *cur, ephem_ctx *ctx)
+{
+    cur->ctx = ctx;
+    cur->next = 0;
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        ephem_track *tr = &cur->track[oid];
+        tr->part = ctx->chain ? NULL : ctx;
+        tr->row = ctx->rows / 2;
+        tr->sub = -1;
+        tr->t0 = 0;
+        tr->t1 = 0;
+        tr->t2 = -1;
+        tr->jd0 = 0;
+        tr->C = NULL;
+    }
+    for (size_t i = 0; i < ephem_cursor_basis; i++) {
+        cur->basis[i].jd = NAN;
+        cur->basis[i].step = 0;
+        cur->basis[i].n = 0;
+    }
+}
+
+static void de440_prefetch_body(ephem_ctx *ctx, size_t row, size_t oid)
+{
+    const char *p;
+    size_t len = de440_body_size(ctx, oid) * de440_format_size(ctx->format);
+
+    /* paged records are only read on demand */
+    if (ctx->pager) {
+        return;
+    }
+    p = ctx->format == ephem_format_f32 ?
+        (const char*)de440_row_body_f32(ctx, row, oid) :
+        (const char*)de440_row_body(ctx, row, oid);
+    for (size_t i = 0; i < len; i += 64) {
+        ephem_prefetch(p + i);
+    }
+}
+
+/*
+ * T_k(tau) depends only on the date and the sub-interval length, so the
+ * basis is shared by all bodies with the same step evaluated at one date.
+ */
+static const double* de440_cursor_basis(ephem_cursor *cur, double jd,
+    size_t row, size_t step, double jd0, size_t n)
+{
+    ephem_basis *b = NULL;
+    double tau;
+
+    for (size_t i = 0; i < ephem_cursor_basis; i++) {
+        if (cur->basis[i].step == step) {
+            b = &cur->basis[i];
+            break;
+        }
+    }
+    if (!b) {
+        b = &cur->basis[cur->next];
+        cur->next = (cur->next + 1) % ephem_cursor_basis;
+        b->step = step;
+        b->jd = NAN;
+    }
+    if (b->jd != jd || b->row != row) {
+        tau = 2*(jd - jd0)/step - 1;
+        b->jd = jd;
+        b->row = row;
+        b->T[0] = 1.0;
+        b->T[1] = tau;
+        b->n = 2;
+    }
+    de440_cheb_basis(b->T, b->n, n);
+    if (b->n < n) {
+        b->n = n;
+    }
+    return b->T;
+}
+
+void de440_cursor_obj(ephem_cursor *cur, double jd, size_t oid, double *obj)
+{
+    ephem_ctx *ctx = cur->ctx;
+    ephem_track *tr = &cur->track[oid];
+    const ephem_body *body;
+    const double *T;
+    double s = 1e3;
+    size_t n, sub;
+
+    if (!(jd >= tr->t1 && jd < tr->t2)) {
+        ephem_ctx *part = ctx;
+        ephem_seg *seg = NULL;
+        size_t row, hint = tr->row;
+        if (ctx->chain) {
+            ephem_chain *ch = ctx->chain;
+            size_t i = de440_chain_seg(ch, jd);
+            seg = i == -1 ? NULL : &ch->seg[i];
+            part = seg ? &ch->part[seg->part] : NULL;
+            hint = part == tr->part ? tr->row : -1;
+        }
+        row = part ? de440_gallop_row(part, jd, hint) : -1;
+        if (row == -1) {
+            obj[0] = NAN; obj[1] = NAN; obj[2] = NAN;
+            tr->t1 = 0; tr->t2 = -1;
+            return;
+        }
+        if (part == tr->part && row > tr->row && row + 1 < part->rows) {
+            de440_prefetch_body(part, row + 1, oid);
+        } else if (part == tr->part && row < tr->row && row > 0) {
+            de440_prefetch_body(part, row - 1, oid);
+        }
+        tr->part = part;
+        tr->row = row;
+        tr->sub = -1;
+        tr->t0 = de440_row_time(part, row)[0];
+        tr->t1 = tr->t0;
+        tr->t2 = de440_row_time(part, row)[1];
+        if (seg) {
+            /* clip to the segment so every date keeps to one file */
+            tr->t1 = tr->t1 > seg->t1 ? tr->t1 : seg->t1;
+            tr->t2 = tr->t2 < seg->t2 ? tr->t2 : seg->t2;
+        }
+    }
+
+    body = &tr->part->body[oid];
+    n = body->n;
+    sub = de440_interval(jd - tr->t0, body->step, body->nsub);
+    if (sub != tr->sub) {
+        tr->sub = sub;
+        tr->jd0 = tr->t0 + body->step * sub;
+        tr->C = de440_sub_coeff(tr->part, tr->row, oid, sub, tr->buf);
+    }
+
+    T = de440_cursor_basis(cur, jd, tr->row, body->step, tr->jd0, n);
+    de440_cheb_dot(tr->C, T, n, obj, s);
+}
+
+/*
+ * one row lookup and one basis per distinct sub-interval step, then the
+ * selected bodies are evaluated in the order they are laid out in the row.
+ */
+void de440_ephem_all(ephem_ctx *ctx, double jd, unsigned mask,
+    double out[][3])
+{
+    double T[ephem_cursor_basis][ephem_max_coeff];
+    size_t steps[ephem_cursor_basis], nT[ephem_cursor_basis];
+    size_t nsteps = 0, row;
+    double buf[3 * ephem_max_coeff];
+    double t1, s = 1e3;
+
+    row = de440_find_row(ctx, jd);
+    if (row != -1 && ctx->chain) {
+        ctx = de440_chain_row(ctx, &row);
+    }
+    if (row == -1) {
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            if (mask & (1u << oid)) {
+                out[oid][0] = NAN; out[oid][1] = NAN; out[oid][2] = NAN;
+            }
+        }
+        return;
+    }
+    t1 = de440_row_time(ctx, row)[0];
+
+    for (size_t i = 0; i < ephem_id_Last; i++) {
+        size_t oid = ephem_order[i], n, sub, j;
+        const ephem_body *body = &ctx->body[oid];
+        double jd0;
+
+        if (!(mask & (1u << oid))) {
+            continue;
+        }
+        n = ctx->body[oid].n;
+        sub = de440_interval(jd - t1, body->step, body->nsub);
+        jd0 = t1 + body->step * sub;
+        for (j = 0; j < nsteps && steps[j] != body->step; j++);
+        if (j == ephem_cursor_basis) {
+            /* more distinct steps than slots, reuse the last */
+            j = --nsteps;
+        }
+        if (j == nsteps) {
+            steps[nsteps++] = body->step;
+            T[j][0] = 1.0;
+            T[j][1] = 2*(jd - jd0)/body->step - 1;
+            nT[j] = 2;
+        }
+        if (nT[j] < n) {
+            de440_cheb_basis(T[j], nT[j], n);
+            nT[j] = n;
+        }
+        de440_cheb_dot(de440_sub_coeff(ctx, row, oid, sub, buf),
+            T[j], n, out[oid], s);
     }
 }
 
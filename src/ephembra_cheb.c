@@ -0,0 +1,473 @@
+/*
+ * ephembra is a tiny ephemeris library for the JPL DE440 Ephemeris
+ *
+ * Copyright (c) 2025 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#include "ephembra.h"
+#include "ephembra_cheb.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define DE440_UNROLL _Pragma("GCC unroll 16")
+#else
+#define DE440_UNROLL
+#endif
+
+/* set lazily by whichever thread dispatches first, racing the others */
+static atomic_int cheb_isa = -1;
+
+#define DE440_FIXED_DEF(N, STEP, OFFSET) \
+void de440_cheb3d_n##N##_s##STEP##_o##OFFSET(const double *B, double dt, \
+    double *r, double scale) \
+{ \
+    size_t i = dt > 0 ? (size_t)(dt / STEP) : 0; \
+    if (i >= DE440_FIXED_SPAN / STEP) { \
+        i = DE440_FIXED_SPAN / STEP - 1; \
+    } \
+    const double *Cx = B + OFFSET * i, *Cy = Cx + N, *Cz = Cy + N; \
+    double tau = 2 * (dt - STEP * i) / STEP - 1; \
+    double T_prev = 1.0, T_curr = tau, T_next; \
+    double sum_x = Cx[0] * T_prev + Cx[1] * T_curr; \
+    double sum_y = Cy[0] * T_prev + Cy[1] * T_curr; \
+    double sum_z = Cz[0] * T_prev + Cz[1] * T_curr; \
+    DE440_UNROLL \
+    for (size_t k = 2; k < N; ++k) { \
+        T_next = 2 * tau * T_curr - T_prev; \
+        sum_x += Cx[k] * T_next; \
+        sum_y += Cy[k] * T_next; \
+        sum_z += Cz[k] * T_next; \
+        T_prev = T_curr; \
+        T_curr = T_next; \
+    } \
+    r[0] = sum_x * scale; \
+    r[1] = sum_y * scale; \
+    r[2] = sum_z * scale; \
+}
+DE440_FIXED_LAYOUTS(DE440_FIXED_DEF)
+#undef DE440_FIXED_DEF
+
+void de440_cheb3d_batch_scalar(size_t m, const double *jd,
+    double jd0, double step, size_t n,
+    const double *Cx, const double *Cy, const double *Cz, double scale,
+    double *x, double *y, double *z, size_t stride)
+{
+    for (size_t l = 0; l < m; l++) {
+        double tau = 2 * (jd[l] - jd0) / step - 1, t2 = 2 * tau;
+        double bx1 = 0, bx2 = 0, by1 = 0, by2 = 0, bz1 = 0, bz2 = 0, b;
+
+        for (size_t k = n - 1; k >= 1; k--) {
+            b = t2 * bx1 - bx2 + Cx[k]; bx2 = bx1; bx1 = b;
+            b = t2 * by1 - by2 + Cy[k]; by2 = by1; by1 = b;
+            b = t2 * bz1 - bz2 + Cz[k]; bz2 = bz1; bz1 = b;
+        }
+
+        x[l * stride] = (tau * bx1 - bx2 + Cx[0]) * scale;
+        y[l * stride] = (tau * by1 - by2 + Cy[0]) * scale;
+        z[l * stride] = (tau * bz1 - bz2 + Cz[0]) * scale;
+    }
+}
+
+double de440_cheb3d_f32_bound(size_t n, const double *Cx,
+    const double *Cy, const double *Cz, double scale)
+{
+    double ex = 0, ey = 0, ez = 0, w;
+
+    for (size_t k = 1; k < n; k++) {
+        w = (double)(n * n + k * k);
+        ex += w * fabs(Cx[k]);
+        ey += w * fabs(Cy[k]);
+        ez += w * fabs(Cz[k]);
+    }
+    return sqrt(ex * ex + ey * ey + ez * ez) * fabs(scale) * 0x1p-23;
+}
+
+#if HAVE_X86_SIMD
+
+__attribute__((target("sse2")))
+static void de440_cheb3d_batch_sse2(size_t m, const double *jd,
+    double jd0, double step, size_t n,
+    const double *Cx, const double *Cy, const double *Cz, double scale,
+    double *x, double *y, double *z, size_t stride)
+{
+    const __m128d v0 = _mm_set1_pd(jd0), vs = _mm_set1_pd(step);
+    const __m128d one = _mm_set1_pd(1.0), two = _mm_set1_pd(2.0);
+    const __m128d sc = _mm_set1_pd(scale);
+    double rx[2], ry[2], rz[2];
+    size_t l = 0;
+
+    for (; l + 2 <= m; l += 2) {
+        __m128d t = _mm_loadu_pd(jd + l);
+        __m128d tau = _mm_sub_pd(_mm_div_pd(_mm_mul_pd(two,
+            _mm_sub_pd(t, v0)), vs), one);
+        __m128d t2 = _mm_mul_pd(two, tau);
+        __m128d bx1 = _mm_setzero_pd(), bx2 = bx1, by1 = bx1, by2 = bx1;
+        __m128d bz1 = bx1, bz2 = bx1, b;
+
+        for (size_t k = n - 1; k >= 1; k--) {
+            b = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(t2, bx1), bx2),
+                _mm_set1_pd(Cx[k]));
+            bx2 = bx1; bx1 = b;
+            b = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(t2, by1), by2),
+                _mm_set1_pd(Cy[k]));
+            by2 = by1; by1 = b;
+            b = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(t2, bz1), bz2),
+                _mm_set1_pd(Cz[k]));
+            bz2 = bz1; bz1 = b;
+        }
+
+        _mm_storeu_pd(rx, _mm_mul_pd(_mm_add_pd(_mm_sub_pd(
+            _mm_mul_pd(tau, bx1), bx2), _mm_set1_pd(Cx[0])), sc));
+        _mm_storeu_pd(ry, _mm_mul_pd(_mm_add_pd(_mm_sub_pd(
+            _mm_mul_pd(tau, by1), by2), _mm_set1_pd(Cy[0])), sc));
+        _mm_storeu_pd(rz, _mm_mul_pd(_mm_add_pd(_mm_sub_pd(
+            _mm_mul_pd(tau, bz1), bz2), _mm_set1_pd(Cz[0])), sc));
+
+        for (size_t i = 0; i < 2; i++) {
+            x[(l + i) * stride] = rx[i];
+            y[(l + i) * stride] = ry[i];
+            z[(l + i) * stride] = rz[i];
+        }
+    }
+
+    de440_cheb3d_batch_scalar(m - l, jd + l, jd0, step, n, Cx, Cy, Cz,
+        scale, x + l * stride, y + l * stride, z + l * stride, stride);
+}
+
+__attribute__((target("avx2,fma")))
+static void de440_cheb3d_batch_avx2(size_t m, const double *jd,
+    double jd0, double step, size_t n,
+    const double *Cx, const double *Cy, const double *Cz, double scale,
+    double *x, double *y, double *z, size_t stride)
+{
+    const __m256d v0 = _mm256_set1_pd(jd0), vs = _mm256_set1_pd(step);
+    const __m256d one = _mm256_set1_pd(1.0), two = _mm256_set1_pd(2.0);
+    const __m256d sc = _mm256_set1_pd(scale);
+    double rx[4], ry[4], rz[4], pad[4];
+    const double *d;
+    size_t l = 0, r;
+
+    /* a last short vector is padded with its last date */
+    for (; l < m; l += r) {
+        r = m - l < 4 ? m - l : 4;
+        d = jd + l;
+        if (r < 4) {
+            for (size_t i = 0; i < 4; i++) {
+                pad[i] = d[i < r ? i : r - 1];
+            }
+            d = pad;
+        }
+        __m256d t = _mm256_loadu_pd(d);
+        __m256d tau = _mm256_sub_pd(_mm256_div_pd(_mm256_mul_pd(two,
+            _mm256_sub_pd(t, v0)), vs), one);
+        __m256d t2 = _mm256_mul_pd(two, tau);
+        __m256d bx1 = _mm256_setzero_pd(), bx2 = bx1, by1 = bx1, by2 = bx1;
+        __m256d bz1 = bx1, bz2 = bx1, b;
+
+        for (size_t k = n - 1; k >= 1; k--) {
+            b = _mm256_fmadd_pd(t2, bx1,
+                _mm256_sub_pd(_mm256_set1_pd(Cx[k]), bx2));
+            bx2 = bx1; bx1 = b;
+            b = _mm256_fmadd_pd(t2, by1,
+                _mm256_sub_pd(_mm256_set1_pd(Cy[k]), by2));
+            by2 = by1; by1 = b;
+            b = _mm256_fmadd_pd(t2, bz1,
+                _mm256_sub_pd(_mm256_set1_pd(Cz[k]), bz2));
+            bz2 = bz1; bz1 = b;
+        }
+
+        _mm256_storeu_pd(rx, _mm256_mul_pd(_mm256_fmadd_pd(tau, bx1,
+            _mm256_sub_pd(_mm256_set1_pd(Cx[0]), bx2)), sc));
+        _mm256_storeu_pd(ry, _mm256_mul_pd(_mm256_fmadd_pd(tau, by1,
+            _mm256_sub_pd(_mm256_set1_pd(Cy[0]), by2)), sc));
+        _mm256_storeu_pd(rz, _mm256_mul_pd(_mm256_fmadd_pd(tau, bz1,
+            _mm256_sub_pd(_mm256_set1_pd(Cz[0]), bz2)), sc));
+
+        for (size_t i = 0; i < r; i++) {
+            x[(l + i) * stride] = rx[i];
+            y[(l + i) * stride] = ry[i];
+            z[(l + i) * stride] = rz[i];
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static void de440_cheb3d_batch_avx512(size_t m, const double *jd,
+    double jd0, double step, size_t n,
+    const double *Cx, const double *Cy, const double *Cz, double scale,
+    double *x, double *y, double *z, size_t stride)
+{
+    const __m512d v0 = _mm512_set1_pd(jd0), vs = _mm512_set1_pd(step);
+    const __m512d one = _mm512_set1_pd(1.0), two = _mm512_set1_pd(2.0);
+    const __m512d sc = _mm512_set1_pd(scale);
+    double rx[8], ry[8], rz[8];
+    size_t l = 0;
+
+    for (; l + 8 <= m; l += 8) {
+        __m512d t = _mm512_loadu_pd(jd + l);
+        __m512d tau = _mm512_sub_pd(_mm512_div_pd(_mm512_mul_pd(two,
+            _mm512_sub_pd(t, v0)), vs), one);
+        __m512d t2 = _mm512_mul_pd(two, tau);
+        __m512d bx1 = _mm512_setzero_pd(), bx2 = bx1, by1 = bx1, by2 = bx1;
+        __m512d bz1 = bx1, bz2 = bx1, b;
+
+        for (size_t k = n - 1; k >= 1; k--) {
+            b = _mm512_fmadd_pd(t2, bx1,
+                _mm512_sub_pd(_mm512_set1_pd(Cx[k]), bx2));
+            bx2 = bx1; bx1 = b;
+            b = _mm512_fmadd_pd(t2, by1,
+                _mm512_sub_pd(_mm512_set1_pd(Cy[k]), by2));
+            by2 = by1; by1 = b;
+            b = _mm512_fmadd_pd(t2, bz1,
+                _mm512_sub_pd(_mm512_set1_pd(Cz[k]), bz2));
+            bz2 = bz1; bz1 = b;
+        }
+
+        _mm512_storeu_pd(rx, _mm512_mul_pd(_mm512_fmadd_pd(tau, bx1,
+            _mm512_sub_pd(_mm512_set1_pd(Cx[0]), bx2)), sc));
+        _mm512_storeu_pd(ry, _mm512_mul_pd(_mm512_fmadd_pd(tau, by1,
+            _mm512_sub_pd(_mm512_set1_pd(Cy[0]), by2)), sc));
+        _mm512_storeu_pd(rz, _mm512_mul_pd(_mm512_fmadd_pd(tau, bz1,
+            _mm512_sub_pd(_mm512_set1_pd(Cz[0]), bz2)), sc));
+
+        for (size_t i = 0; i < 8; i++) {
+            x[(l + i) * stride] = rx[i];
+            y[(l + i) * stride] = ry[i];
+            z[(l + i) * stride] = rz[i];
+        }
+    }
+
+    de440_cheb3d_batch_avx2(m - l, jd + l, jd0, step, n, Cx, Cy, Cz,
+        scale, x + l * stride, y + l * stride, z + l * stride, stride);
+}
+
+/* C[0] + tau * b1 - b2 in double, four lanes at a time */
+__attribute__((target("avx2,fma")))
+static inline void de440_f32_last_avx2(__m256 tau, __m256 b1, __m256 b2,
+    double c0, __m256d sc, double *r)
+{
+    const __m256d c = _mm256_set1_pd(c0);
+
+    _mm256_storeu_pd(r, _mm256_mul_pd(_mm256_fmadd_pd(
+        _mm256_cvtps_pd(_mm256_castps256_ps128(tau)),
+        _mm256_cvtps_pd(_mm256_castps256_ps128(b1)),
+        _mm256_sub_pd(c, _mm256_cvtps_pd(_mm256_castps256_ps128(b2)))), sc));
+    _mm256_storeu_pd(r + 4, _mm256_mul_pd(_mm256_fmadd_pd(
+        _mm256_cvtps_pd(_mm256_extractf128_ps(tau, 1)),
+        _mm256_cvtps_pd(_mm256_extractf128_ps(b1, 1)),
+        _mm256_sub_pd(c, _mm256_cvtps_pd(_mm256_extractf128_ps(b2, 1)))), sc));
+}
+
+__attribute__((target("avx2,fma")))
+static void de440_cheb3d_batch_f32_avx2(size_t m, const double *jd,
+    double jd0, double step, size_t n,
+    const double *Cx, const double *Cy, const double *Cz, double scale,
+    double *x, double *y, double *z, size_t stride)
+{
+    const __m256d v0 = _mm256_set1_pd(jd0), vs = _mm256_set1_pd(2 / step);
+    const __m256d one = _mm256_set1_pd(1.0), sc = _mm256_set1_pd(scale);
+    float fx[ephem_max_coeff], fy[ephem_max_coeff], fz[ephem_max_coeff];
+    double rx[8], ry[8], rz[8], pad[8];
+    const double *t;
+    size_t l = 0, r;
+
+    for (size_t k = 0; m > 0 && k < n; k++) {
+        fx[k] = (float)Cx[k]; fy[k] = (float)Cy[k]; fz[k] = (float)Cz[k];
+    }
+
+    /* a last short vector is padded with its last date */
+    for (; l < m; l += r) {
+        r = m - l < 8 ? m - l : 8;
+        t = jd + l;
+        if (r < 8) {
+            for (size_t i = 0; i < 8; i++) {
+                pad[i] = t[i < r ? i : r - 1];
+            }
+            t = pad;
+        }
+        __m256d d0 = _mm256_fmsub_pd(
+            _mm256_sub_pd(_mm256_loadu_pd(t), v0), vs, one);
+        __m256d d1 = _mm256_fmsub_pd(
+            _mm256_sub_pd(_mm256_loadu_pd(t + 4), v0), vs, one);
+        __m256 tau = _mm256_insertf128_ps(_mm256_castps128_ps256(
+            _mm256_cvtpd_ps(d0)), _mm256_cvtpd_ps(d1), 1);
+        __m256 t2 = _mm256_add_ps(tau, tau);
+        __m256 bx1 = _mm256_setzero_ps(), bx2 = bx1, by1 = bx1, by2 = bx1;
+        __m256 bz1 = bx1, bz2 = bx1, b;
+
+        for (size_t k = n - 1; k >= 1; k--) {
+            b = _mm256_fmadd_ps(t2, bx1,
+                _mm256_sub_ps(_mm256_set1_ps(fx[k]), bx2));
+            bx2 = bx1; bx1 = b;
+            b = _mm256_fmadd_ps(t2, by1,
+                _mm256_sub_ps(_mm256_set1_ps(fy[k]), by2));
+            by2 = by1; by1 = b;
+            b = _mm256_fmadd_ps(t2, bz1,
+                _mm256_sub_ps(_mm256_set1_ps(fz[k]), bz2));
+            bz2 = bz1; bz1 = b;
+        }
+
+        de440_f32_last_avx2(tau, bx1, bx2, Cx[0], sc, rx);
+        de440_f32_last_avx2(tau, by1, by2, Cy[0], sc, ry);
+        de440_f32_last_avx2(tau, bz1, bz2, Cz[0], sc, rz);
+
+        for (size_t i = 0; i < r; i++) {
+            x[(l + i) * stride] = rx[i];
+            y[(l + i) * stride] = ry[i];
+            z[(l + i) * stride] = rz[i];
+        }
+    }
+}
+
+/* C[0] + tau * b1 - b2 in double, eight lanes at a time */
+__attribute__((target("avx512f")))
+static inline void de440_f32_last_avx512(__m512 tau, __m512 b1, __m512 b2,
+    double c0, __m512d sc, double *r)
+{
+    const __m512d c = _mm512_set1_pd(c0);
+
+    _mm512_storeu_pd(r, _mm512_mul_pd(_mm512_fmadd_pd(
+        _mm512_cvtps_pd(_mm512_castps512_ps256(tau)),
+        _mm512_cvtps_pd(_mm512_castps512_ps256(b1)),
+        _mm512_sub_pd(c, _mm512_cvtps_pd(_mm512_castps512_ps256(b2)))), sc));
+    _mm512_storeu_pd(r + 8, _mm512_mul_pd(_mm512_fmadd_pd(
+        _mm512_cvtps_pd(_mm256_castpd_ps(
+            _mm512_extractf64x4_pd(_mm512_castps_pd(tau), 1))),
+        _mm512_cvtps_pd(_mm256_castpd_ps(
+            _mm512_extractf64x4_pd(_mm512_castps_pd(b1), 1))),
+        _mm512_sub_pd(c, _mm512_cvtps_pd(_mm256_castpd_ps(
+            _mm512_extractf64x4_pd(_mm512_castps_pd(b2), 1))))), sc));
+}
+
+__attribute__((target("avx512f")))
+static void de440_cheb3d_batch_f32_avx512(size_t m, const double *jd,
+    double jd0, double step, size_t n,
+    const double *Cx, const double *Cy, const double *Cz, double scale,
+    double *x, double *y, double *z, size_t stride)
+{
+    const __m512d v0 = _mm512_set1_pd(jd0), vs = _mm512_set1_pd(2 / step);
+    const __m512d one = _mm512_set1_pd(1.0), sc = _mm512_set1_pd(scale);
+    float fx[ephem_max_coeff], fy[ephem_max_coeff], fz[ephem_max_coeff];
+    double rx[16], ry[16], rz[16];
+    size_t l = 0, r;
+
+    for (size_t k = 0; m > 0 && k < n; k++) {
+        fx[k] = (float)Cx[k]; fy[k] = (float)Cy[k]; fz[k] = (float)Cz[k];
+    }
+
+    /* lanes past the end of a last short vector load its last date */
+    for (; l < m; l += r) {
+        r = m - l < 16 ? m - l : 16;
+        __mmask16 mk = r < 16 ? (__mmask16)((1u << r) - 1) : 0xffff;
+        __m512d last = _mm512_set1_pd(jd[m - 1]);
+        __m512d d0 = _mm512_fmsub_pd(_mm512_sub_pd(
+            _mm512_mask_loadu_pd(last, (__mmask8)mk, jd + l), v0), vs, one);
+        __m512d d1 = _mm512_fmsub_pd(_mm512_sub_pd(
+            _mm512_mask_loadu_pd(last, (__mmask8)(mk >> 8), jd + l + 8), v0),
+            vs, one);
+        __m512 tau = _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(
+            _mm512_castps256_ps512(_mm512_cvtpd_ps(d0))),
+            _mm256_castps_pd(_mm512_cvtpd_ps(d1)), 1));
+        __m512 t2 = _mm512_add_ps(tau, tau);
+        __m512 bx1 = _mm512_setzero_ps(), bx2 = bx1, by1 = bx1, by2 = bx1;
+        __m512 bz1 = bx1, bz2 = bx1, b;
+
+        for (size_t k = n - 1; k >= 1; k--) {
+            b = _mm512_fmadd_ps(t2, bx1,
+                _mm512_sub_ps(_mm512_set1_ps(fx[k]), bx2));
+            bx2 = bx1; bx1 = b;
+            b = _mm512_fmadd_ps(t2, by1,
+                _mm512_sub_ps(_mm512_set1_ps(fy[k]), by2));
+            by2 = by1; by1 = b;
+            b = _mm512_fmadd_ps(t2, bz1,
+                _mm512_sub_ps(_mm512_set1_ps(fz[k]), bz2));
+            bz2 = bz1; bz1 = b;
+        }
+
+        de440_f32_last_avx512(tau, bx1, bx2, Cx[0], sc, rx);
+        de440_f32_last_avx512(tau, by1, by2, Cy[0], sc, ry);
+        de440_f32_last_avx512(tau, bz1, bz2, Cz[0], sc, rz);
+
+        for (size_t i = 0; i < r; i++) {
+            x[(l + i) * stride] = rx[i];
+            y[(l + i) * stride] = ry[i];
+            z[(l + i) * stride] = rz[i];
+        }
+    }
+}
+
+static int de440_cpu_isa(void)
+{
+    __builtin_cpu_init();
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("fma")) {
+        return ephem_isa_sse2;
+    }
+    return __builtin_cpu_supports("avx512f") ? ephem_isa_avx512 :
+        ephem_isa_avx2;
+}
+
+#else
+
+static int de440_cpu_isa(void)
+{
+    return ephem_isa_scalar;
+}
+
+#endif
+
+int de440_set_isa(int isa)
+{
+    int max = de440_cpu_isa();
+    isa = (isa < 0 || isa > max) ? max : isa;
+    atomic_store_explicit(&cheb_isa, isa, memory_order_relaxed);
+    return isa;
+}
+
+int de440_get_isa(void)
+{
+    int isa = atomic_load_explicit(&cheb_isa, memory_order_relaxed);
+    return isa < 0 ? de440_set_isa(-1) : isa;
+}
+
+de440_cheb3d_batch_fn de440_cheb3d_batch(void)
+{
+    switch (de440_get_isa()) {
+#if HAVE_X86_SIMD
+    case ephem_isa_avx512: return de440_cheb3d_batch_avx512;
+    case ephem_isa_avx2: return de440_cheb3d_batch_avx2;
+    case ephem_isa_sse2: return de440_cheb3d_batch_sse2;
+#endif
+    default: return de440_cheb3d_batch_scalar;
+    }
+}
+
+de440_cheb3d_batch_fn de440_cheb3d_batch_f32(void)
+{
+    switch (de440_get_isa()) {
+#if HAVE_X86_SIMD
+    case ephem_isa_avx512: return de440_cheb3d_batch_f32_avx512;
+    case ephem_isa_avx2: return de440_cheb3d_batch_f32_avx2;
+#endif
+    default: return NULL;
+    }
+}
@@ -0,0 +1,95 @@
+/*
+ * ephembra is a tiny ephemeris library for the JPL DE440 Ephemeris
+ *
+ * Copyright (c) 2025 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * batch Chebyshev kernels evaluate m dates that share one set of
+ * coefficients, i.e. the dates fall in the same record and sub-interval.
+ * all variants use the Clenshaw recurrence. the scalar and SSE2 variants
+ * round identically; the AVX2 and AVX-512 variants fuse multiply-adds and
+ * agree with the scalar variant to within n^2 ulp of scale * sum(|C[k]|),
+ * n being the coefficient count (below 2n ulp measured in table sweeps).
+ * each variant gives a date the same result wherever it falls in the
+ * group: AVX2 pads a last short vector and AVX-512 leaves its last dates
+ * to AVX2, so a group may be split without changing the output.
+ */
+
+typedef void (*de440_cheb3d_batch_fn)(size_t m, const double *jd,
+    double jd0, double step, size_t n,
+    const double *Cx, const double *Cy, const double *Cz, double scale,
+    double *x, double *y, double *z, size_t stride);
+
+void de440_cheb3d_batch_scalar(size_t m, const double *jd,
+    double jd0, double step, size_t n,
+    const double *Cx, const double *Cy, const double *Cz, double scale,
+    double *x, double *y, double *z, size_t stride);
+
+de440_cheb3d_batch_fn de440_cheb3d_batch(void);
+
+/*
+ * float32 batch kernels run the recurrence in single precision, 8 dates
+ * to a vector with AVX2 and 16 with AVX-512. tau is formed in double and
+ * rounded once, and the last step, adding C[0], is taken in double so the
+ * error scales with the higher coefficients only. de440_cheb3d_f32_bound
+ * bounds the error: n^2 ulp of scale * sum(|C[k]|), k >= 1, for the
+ * recurrence plus k^2 ulp of scale * |C[k]| for the rounding of tau, as a
+ * vector norm. a last short vector is padded, or masked with AVX-512, so
+ * groups of any size stay in float32. there are none for ISAs without
+ * wide vectors, de440_cheb3d_batch_f32 returning NULL, and callers use
+ * the double kernels, whose rounding the f32 bound does not apply to.
+ */
+
+de440_cheb3d_batch_fn de440_cheb3d_batch_f32(void);
+
+double de440_cheb3d_f32_bound(size_t n, const double *Cx,
+    const double *Cy, const double *Cz, double scale);
+
+/*
+ * fixed-layout kernels evaluate one date for one body layout. the record
+ * span, coefficient count, sub-interval step and sub-interval offset are
+ * compile-time constants so the recurrence is fully unrolled and the index
+ * arithmetic folds away. B points at the body's first coefficient in the
+ * record and dt is the date relative to the record start.
+ */
+
+#define DE440_FIXED_SPAN 32
+
+#define DE440_FIXED_LAYOUTS(X) \
+    X(6, 32, 0)   \
+    X(7, 32, 0)   \
+    X(8, 32, 0)   \
+    X(10, 8, 20)  \
+    X(10, 8, 30)  \
+    X(10, 16, 30) \
+    X(11, 16, 33) \
+    X(11, 32, 0)  \
+    X(13, 4, 39)  \
+    X(13, 16, 39) \
+    X(14, 8, 42)
+
+typedef void (*de440_cheb3d_fixed_fn)(const double *B, double dt,
+    double *r, double scale);
+
+#define DE440_FIXED_DECL(N, STEP, OFFSET) \
+void de440_cheb3d_n##N##_s##STEP##_o##OFFSET(const double *B, double dt, \
+    double *r, double scale);
+DE440_FIXED_LAYOUTS(DE440_FIXED_DECL)
+#undef DE440_FIXED_DECL
@@ -0,0 +1,248 @@
+/*
+ * ephembra is a tiny ephemeris library for the JPL DE440 Ephemeris
+ *
+ * Copyright (c) 2025 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ephembra.h"
+#include "ephembra_pack.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+enum {
+    pack_plane_zero = 0,
+    pack_plane_raw = 1,
+    pack_plane_mask = 2
+};
+
+typedef void (*de440_interleave_fn)(const uint8_t *p, size_t n, uint64_t *w);
+
+size_t de440_pack_bound(size_t nrec, size_t rec)
+{
+    return 8 * (1 + nrec * rec);
+}
+
+size_t de440_pack_block(const uint64_t *w, size_t nrec, size_t rec,
+    uint8_t *out, uint8_t *scratch)
+{
+    size_t n = nrec * rec, len = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        uint64_t d = w[i] ^ (i >= rec ? w[i - rec] : 0);
+        for (size_t j = 0; j < 8; j++) {
+            scratch[j * n + i] = (uint8_t)(d >> (8 * j));
+        }
+    }
+
+    for (size_t j = 0; j < 8; j++) {
+        const uint8_t *p = scratch + j * n;
+        size_t nz = 0, nmask = (n + 7) / 8;
+
+        for (size_t i = 0; i < n; i++) {
+            nz += p[i] != 0;
+        }
+        if (nz == 0) {
+            out[len++] = pack_plane_zero;
+        } else if (nmask + nz >= n) {
+            out[len++] = pack_plane_raw;
+            memcpy(out + len, p, n);
+            len += n;
+        } else {
+            uint8_t *mask = out + len + 1, *bytes = mask + nmask;
+            out[len++] = pack_plane_mask;
+            memset(mask, 0, nmask);
+            for (size_t i = 0; i < n; i++) {
+                if (p[i]) {
+                    mask[i >> 3] |= 1 << (i & 7);
+                    *bytes++ = p[i];
+                }
+            }
+            len += nmask + nz;
+        }
+    }
+
+    return len;
+}
+
+/* words i to n from eight byte planes of n bytes */
+static void de440_interleave_tail(const uint8_t *p, size_t n, size_t i,
+    uint64_t *w)
+{
+    for (; i < n; i++) {
+        uint64_t d = 0;
+        for (size_t j = 0; j < 8; j++) {
+            d |= (uint64_t)p[j * n + i] << (8 * j);
+        }
+        w[i] = d;
+    }
+}
+
+static void de440_interleave_scalar(const uint8_t *p, size_t n, uint64_t *w)
+{
+    de440_interleave_tail(p, n, 0, w);
+}
+
+#if HAVE_X86_SIMD
+
+/*
+ * byte plane transpose by three rounds of unpacks: bytes to 16-bit pairs,
+ * pairs to 32-bit quads and quads to 64-bit words. quad q holds the low
+ * or high four bytes of four words, x indexes the low quads of group q.
+ */
+__attribute__((target("sse2")))
+static void de440_interleave_sse2(const uint8_t *p, size_t n, uint64_t *w)
+{
+    __m128i v[8], a[8], b[8];
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        for (size_t j = 0; j < 8; j++) {
+            v[j] = _mm_loadu_si128((const __m128i*)(p + j * n + i));
+        }
+        for (size_t j = 0; j < 8; j += 2) {
+            a[j] = _mm_unpacklo_epi8(v[j], v[j + 1]);
+            a[j + 1] = _mm_unpackhi_epi8(v[j], v[j + 1]);
+        }
+        for (size_t h = 0; h < 2; h++) {
+            b[4 * h + 0] = _mm_unpacklo_epi16(a[h], a[h + 2]);
+            b[4 * h + 1] = _mm_unpackhi_epi16(a[h], a[h + 2]);
+            b[4 * h + 2] = _mm_unpacklo_epi16(a[h + 4], a[h + 6]);
+            b[4 * h + 3] = _mm_unpackhi_epi16(a[h + 4], a[h + 6]);
+        }
+        for (size_t q = 0; q < 4; q++) {
+            size_t x = (q >> 1) * 4 + (q & 1);
+            _mm_storeu_si128((__m128i*)(w + i + 4 * q),
+                _mm_unpacklo_epi32(b[x], b[x + 2]));
+            _mm_storeu_si128((__m128i*)(w + i + 4 * q + 2),
+                _mm_unpackhi_epi32(b[x], b[x + 2]));
+        }
+    }
+    de440_interleave_tail(p, n, i, w);
+}
+
+/*
+ * the unpacks work within 128-bit lanes, so the low lanes hold words for
+ * bytes 0-15 and the high lanes words for bytes 16-31 of each plane.
+ */
+__attribute__((target("avx2")))
+static void de440_interleave_avx2(const uint8_t *p, size_t n, uint64_t *w)
+{
+    __m256i v[8], a[8], b[8];
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        for (size_t j = 0; j < 8; j++) {
+            v[j] = _mm256_loadu_si256((const __m256i*)(p + j * n + i));
+        }
+        for (size_t j = 0; j < 8; j += 2) {
+            a[j] = _mm256_unpacklo_epi8(v[j], v[j + 1]);
+            a[j + 1] = _mm256_unpackhi_epi8(v[j], v[j + 1]);
+        }
+        for (size_t h = 0; h < 2; h++) {
+            b[4 * h + 0] = _mm256_unpacklo_epi16(a[h], a[h + 2]);
+            b[4 * h + 1] = _mm256_unpackhi_epi16(a[h], a[h + 2]);
+            b[4 * h + 2] = _mm256_unpacklo_epi16(a[h + 4], a[h + 6]);
+            b[4 * h + 3] = _mm256_unpackhi_epi16(a[h + 4], a[h + 6]);
+        }
+        for (size_t q = 0; q < 4; q++) {
+            size_t x = (q >> 1) * 4 + (q & 1);
+            __m256i lo = _mm256_unpacklo_epi32(b[x], b[x + 2]);
+            __m256i hi = _mm256_unpackhi_epi32(b[x], b[x + 2]);
+            _mm256_storeu_si256((__m256i*)(w + i + 4 * q),
+                _mm256_permute2x128_si256(lo, hi, 0x20));
+            _mm256_storeu_si256((__m256i*)(w + i + 16 + 4 * q),
+                _mm256_permute2x128_si256(lo, hi, 0x31));
+        }
+    }
+    de440_interleave_tail(p, n, i, w);
+}
+
+#endif
+
+static de440_interleave_fn de440_interleave(void)
+{
+    switch (de440_get_isa()) {
+#if HAVE_X86_SIMD
+    case ephem_isa_avx512:
+    case ephem_isa_avx2: return de440_interleave_avx2;
+    case ephem_isa_sse2: return de440_interleave_sse2;
+#endif
+    default: return de440_interleave_scalar;
+    }
+}
+
+int de440_unpack_block(const uint8_t *in, size_t len, size_t nrec,
+    size_t rec, uint64_t *w, uint8_t *scratch)
+{
+    const uint8_t *end = in + len;
+    size_t n = nrec * rec, nmask = (n + 7) / 8;
+
+    for (size_t j = 0; j < 8; j++) {
+        uint8_t *p = scratch + j * n;
+        if (in >= end) {
+            return -1;
+        }
+        switch (*in++) {
+        case pack_plane_zero:
+            memset(p, 0, n);
+            break;
+        case pack_plane_raw:
+            if ((size_t)(end - in) < n) {
+                return -1;
+            }
+            memcpy(p, in, n);
+            in += n;
+            break;
+        case pack_plane_mask: {
+            const uint8_t *mask = in, *bytes = in + nmask;
+            if ((size_t)(end - in) < nmask) {
+                return -1;
+            }
+            for (size_t i = 0; i < n; i++) {
+                if (mask[i >> 3] & (1 << (i & 7))) {
+                    if (bytes >= end) {
+                        return -1;
+                    }
+                    p[i] = *bytes++;
+                } else {
+                    p[i] = 0;
+                }
+            }
+            in = bytes;
+            break;
+        }
+        default:
+            return -1;
+        }
+    }
+
+    de440_interleave()(scratch, n, w);
+    for (size_t r = 1; r < nrec; r++) {
+        const uint64_t *prev = w + (r - 1) * rec;
+        uint64_t *cur = w + r * rec;
+        for (size_t c = 0; c < rec; c++) {
+            cur[c] ^= prev[c];
+        }
+    }
+
+    return in == end ? 0 : -1;
+}
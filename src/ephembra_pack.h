@@ -0,0 +1,37 @@
+/*
+ * ephembra is a tiny ephemeris library for the JPL DE440 Ephemeris
+ *
+ * Copyright (c) 2025 Michael Clark <michaeljclark@mac.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * lossless block codec for runs of records. each word is XORed with the
+ * same word of the previous record, which clears the sign, exponent and
+ * leading mantissa bits shared by neighbouring records. the words are
+ * split into eight byte planes and each plane is stored as all zero, raw,
+ * or as a bitmap of its non-zero bytes followed by those bytes. blocks
+ * are independent so they decode in any order.
+ */
+
+size_t de440_pack_bound(size_t nrec, size_t rec);
+size_t de440_pack_block(const uint64_t *w, size_t nrec, size_t rec,
+    uint8_t *out, uint8_t *scratch);
+int de440_unpack_block(const uint8_t *in, size_t len, size_t nrec,
+    size_t rec, uint64_t *w, uint8_t *scratch);
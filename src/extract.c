@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "ephembra.h"
+
+#define VA_ARGS(...) , ##__VA_ARGS__
+#define ephem_error(fmt, ...) \
+    fprintf(stderr, fmt "\n" VA_ARGS(__VA_ARGS__)); exit(1);
+
+/*
+ * extract slices an ephemeris down to the records overlapping a date
+ * window and a subset of bodies. the output is written by de440_save_ephem
+ * so the record bounds, layout table and index are rebuilt for the slice
+ * and dropped bodies are marked absent, evaluating to NaN.
+ */
+
+static int has_suffix(const char *s, const char *suffix)
+{
+    size_t l = strlen(s), m = strlen(suffix);
+    return l >= m && strcmp(s + l - m, suffix) == 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-s date] [-e date] [-o objects] [-m mask] "
+        "[-b] [-f f64|f32|packed] [-t metres]\n"
+        "    [DE440Coeff.bin|de440.bsp] [out.bin]\n"
+        "  -s  first date to keep, julian or yyyy-mm-dd (default the start)\n"
+        "  -e  last date to keep, julian or yyyy-mm-dd (default the end)\n"
+        "  -o  comma separated object names or ids, e.g. sun,earth,moon\n"
+        "  -m  mask of object ids to keep (default all)\n"
+        "  -b  body-major layout (default record-major)\n"
+        "  -f  coefficient format (default f64)\n"
+        "  -t  truncate coefficients to this position error in metres\n"
+        "the earth coefficients are the earth-moon barycenter, keep the moon\n"
+        "to derive the geocentric earth.\n",
+        prog);
+    exit(1);
+}
+
+/* julian date at 0h of a gregorian calendar date, or a julian date */
+static double parse_date(const char *prog, const char *s)
+{
+    char *end;
+    double jd;
+    int y, m, d;
+
+    if (sscanf(s, "%d-%d-%d", &y, &m, &d) == 3 && strchr(s + 1, '-')) {
+        if (m < 1 || m > 12 || d < 1 || d > 31) {
+            usage(prog);
+        }
+        return (1461 * (y + 4800 + (m - 14) / 12)) / 4 +
+            (367 * (m - 2 - 12 * ((m - 14) / 12))) / 12 -
+            (3 * ((y + 4900 + (m - 14) / 12) / 100)) / 4 + d - 32075 - 0.5;
+    }
+    jd = strtod(s, &end);
+    if (end == s || *end) {
+        usage(prog);
+    }
+    return jd;
+}
+
+static unsigned parse_objects(const char *prog, const char *s)
+{
+    char buf[256], *tok, *end;
+    unsigned mask = 0;
+    size_t oid;
+
+    snprintf(buf, sizeof(buf), "%s", s);
+    for (tok = strtok(buf, ","); tok; tok = strtok(NULL, ",")) {
+        oid = strtoul(tok, &end, 10);
+        if (end == tok || *end) {
+            for (oid = 0; oid < ephem_id_Last &&
+                strcasecmp(tok, de440_object_name(oid)) != 0; oid++);
+        }
+        if (oid >= ephem_id_Last) {
+            fprintf(stderr, "unknown object: %s\n", tok);
+            usage(prog);
+        }
+        mask |= 1u << oid;
+    }
+    return mask;
+}
+
+static size_t file_size(const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) != 0) {
+        ephem_error("stat: failed: %s", path);
+    }
+    return st.st_size;
+}
+
+int main(int argc, char **argv)
+{
+    ephem_ctx ctx;
+    ephem_save_opts opts = {
+        ephem_layout_row, ephem_format_f64, 0, 0, 0, 0, 0, 0
+    };
+    const char *in, *out;
+    size_t in_size, out_size;
+    int i = 1;
+
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            opts.jd_start = parse_date(argv[0], argv[++i]);
+        } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+            opts.jd_end = parse_date(argv[0], argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            opts.mask |= parse_objects(argv[0], argv[++i]);
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            opts.mask |= strtoul(argv[++i], NULL, 0) & ephem_mask_all;
+        } else if (strcmp(argv[i], "-b") == 0) {
+            opts.layout = ephem_layout_body;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "f64") == 0) {
+                opts.format = ephem_format_f64;
+            } else if (strcmp(argv[i], "f32") == 0) {
+                opts.format = ephem_format_f32;
+            } else if (strcmp(argv[i], "packed") == 0) {
+                opts.format = ephem_format_packed;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            opts.tolerance = strtod(argv[++i], NULL);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - i != 2) {
+        usage(argv[0]);
+    }
+    in = argv[i];
+    out = argv[i + 1];
+    if (opts.jd_start != 0 && opts.jd_end != 0 &&
+            opts.jd_end <= opts.jd_start) {
+        ephem_error("extract: window ends before it starts: %.1f to %.1f",
+            opts.jd_start, opts.jd_end);
+    }
+
+    if (has_suffix(in, ".bsp")) {
+        de440_spk_ephem(&ctx, in, 0);
+    } else {
+        de440_map_ephem(&ctx, in, 0);
+    }
+    de440_save_ephem(&ctx, out, &opts);
+    de440_destroy_ephem(&ctx);
+
+    in_size = file_size(in);
+    out_size = file_size(out);
+    de440_map_ephem(&ctx, out, 0);
+    printf("%zu records from %.1f to %.1f, %zu of %zu bytes (%.2f%%)\n",
+        ctx.rows, ctx.jd_start, ctx.jd_start + ctx.rows * ctx.span,
+        out_size, in_size, 100.0 * out_size / in_size);
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        if (ctx.absent & (1u << oid)) {
+            printf("%-12s absent\n", de440_object_name(oid));
+        } else {
+            printf("%-12s n=%-2zu err=%.3g m\n", de440_object_name(oid),
+                ctx.body[oid].n, ctx.body[oid].err);
+        }
+    }
+    de440_destroy_ephem(&ctx);
+    return 0;
+}
@@ -165,6 +165,7 @@ void lv_ephem_init(lv_app *app)
     lv_current_date(app);
     de440_create_ephem(&app->ctx, ephembra_data_file);
     app->eph = (double*)malloc(countof(data) * app->steps * sizeof(double) * 3);
+    app->tjd = (double*)malloc(app->steps * sizeof(double));
     app->images = (int*)malloc(countof(data) * sizeof(int));
     nvgCreateFont(vg, "mono", ephembra_mono_font);
     nvgCreateFont(vg, "sans", ephembra_sans_font);
@@ -189,20 +190,20 @@ void lv_ephem_destroy(lv_app *app)
 
     free(app->images);
     free(app->eph);
+    free(app->tjd);
 }
 
 void lv_ephem_calc(lv_app *app, double jd)
 {
     for (size_t oid = 1; oid < countof(data); oid++)
     {
+        double interval = data[oid].orbit / app->steps;
         for (size_t i = 0; i < app->steps; i++)
         {
-            double interval = data[oid].orbit / app->steps;
-            double tjd = jd - (i * interval);
-            size_t row = de440_find_row(&app->ctx, tjd);
-            double *o = lv_ephem_object(app, oid, i);
-            de440_ephem_obj(&app->ctx, tjd, row, oid, o);
+            app->tjd[i] = jd - (i * interval);
         }
+        de440_ephem_batch_f32(&app->ctx, oid, app->tjd, app->steps, 0,
+            lv_ephem_object(app, oid, 0));
     }
 }
 
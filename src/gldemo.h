@@ -76,6 +76,7 @@ struct lv_app
     float zodiac_offset;
     float zodiac_scale;
     double *eph;
+    double *tjd;
     int *images;
     int font;
     ephem_ctx ctx;
@@ -0,0 +1,1145 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "ephembra.h"
+
+/*
+ * test_ephembra generates a small ephemeris, saves it in each layout and
+ * format and checks that the files evaluate as the original does when read
+ * by de440_create_ephem: mapped, paged and chained, laid out by a JPL ASCII
+ * header or written as SPK kernels. when ctest gives the paths of the tools,
+ * convert reads it from JPL ASCII files, embed slices it into a header whose
+ * words are loaded by de440_create_embedded and extract slices it by
+ * calendar dates and body names. the batch kernels of each ISA are checked
+ * against the scalar one, derivatives against finite differences, cursors,
+ * queries and all bodies at a date against single lookups, truncated
+ * evaluation against its error bound, and parallel batches, the result cache
+ * and single dates from several threads against serial evaluation. it can
+ * run under the thread sanitizer with ENABLE_TSAN. files are written to a
+ * directory made under TMPDIR and removed at exit.
+ */
+
+#define TEST_ROWS 48
+#define TEST_COLS 1018
+#define TEST_START 2451536.5
+#define TEST_DATES 4000
+#define TEST_THREADS 4
+#define TEST_FIXTURES 64
+
+static size_t failures;
+static char fixture_dir[256];
+static char *fixtures[TEST_FIXTURES];
+static size_t nfixtures;
+
+static void check(int ok, const char *what, const char *name)
+{
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s: %s\n", what, name);
+        failures++;
+    }
+}
+
+static void remove_fixtures(void)
+{
+    for (size_t i = 0; i < nfixtures; i++) {
+        unlink(fixtures[i]);
+        free(fixtures[i]);
+    }
+    if (fixture_dir[0]) {
+        rmdir(fixture_dir);
+    }
+}
+
+/* path of a file in the fixture directory, made on first use */
+static const char* fixture(const char *name)
+{
+    size_t len;
+
+    if (!fixture_dir[0]) {
+        const char *tmp = getenv("TMPDIR");
+        snprintf(fixture_dir, sizeof(fixture_dir), "%s/ephembra-XXXXXX",
+            tmp && tmp[0] ? tmp : "/tmp");
+        if (!mkdtemp(fixture_dir)) {
+            fprintf(stderr, "mkdtemp: failed: %s\n", fixture_dir);
+            exit(1);
+        }
+        atexit(remove_fixtures);
+    }
+    for (size_t i = 0; i < nfixtures; i++) {
+        if (strcmp(fixtures[i] + strlen(fixture_dir) + 1, name) == 0) {
+            return fixtures[i];
+        }
+    }
+    len = strlen(fixture_dir) + strlen(name) + 2;
+    if (nfixtures == TEST_FIXTURES || !(fixtures[nfixtures] = malloc(len))) {
+        fprintf(stderr, "fixture: too many files: %s\n", name);
+        exit(1);
+    }
+    snprintf(fixtures[nfixtures], len, "%s/%s", fixture_dir, name);
+    return fixtures[nfixtures++];
+}
+
+/* record bounds and coefficients that fall off like a smooth series */
+static void generate(const char *path)
+{
+    ephem_ctx ctx;
+    ephem_save_opts opts = {
+        ephem_layout_row, ephem_format_f64, 0, 0, 1, 0, 0, 0
+    };
+    double *PC = malloc(TEST_ROWS * TEST_COLS * sizeof(double));
+    unsigned seed = 1;
+
+    if (!PC) {
+        fprintf(stderr, "malloc: failed\n");
+        exit(1);
+    }
+    for (size_t r = 0; r < TEST_ROWS; r++) {
+        double *R = PC + r * TEST_COLS;
+        R[0] = TEST_START + 32.0 * r;
+        R[1] = R[0] + 32.0;
+        for (size_t c = 2; c < TEST_COLS; c++) {
+            double u = (double)rand_r(&seed) / RAND_MAX - 0.5;
+            R[c] = u * 1e8 * pow(10.0, -(double)((c * 7) % 14));
+        }
+    }
+    de440_init_ephem(&ctx, TEST_ROWS, TEST_COLS, PC);
+    de440_save_ephem(&ctx, path, &opts);
+    de440_destroy_ephem(&ctx);
+}
+
+/* dates across the file and a little past either end, with boundaries */
+static void dates(double *jd, size_t n)
+{
+    unsigned seed = 2;
+
+    for (size_t k = 0; k < n; k++) {
+        if (k % 5 == 0) {
+            jd[k] = TEST_START - 3 + (32.0 * TEST_ROWS + 6) * rand_r(&seed) /
+                RAND_MAX;
+        } else if (k % 5 == 1) {
+            jd[k] = TEST_START + 32.0 * (rand_r(&seed) % (TEST_ROWS + 1));
+        } else {
+            jd[k] = TEST_START + 32.0 * TEST_ROWS * k / n;
+        }
+    }
+}
+
+static int same(double a, double b, double tol)
+{
+    return (isnan(a) && isnan(b)) || fabs(a - b) <= tol;
+}
+
+/*
+ * n^2 ulp of scale * sum(|C[k]|) over the three axes of the sub-interval
+ * holding a date, the bound the batch kernels round within
+ */
+static double ulps(ephem_ctx *ref, double jd, size_t oid)
+{
+    const ephem_body *b = &ref->body[oid];
+    size_t row = de440_find_row(ref, jd), sub;
+    const double *C;
+    double t0, sum = 0;
+
+    if (row == (size_t)-1) {
+        return 0;
+    }
+    t0 = ref->PC[row * ref->cols];
+    sub = jd > t0 ? (size_t)((jd - t0) / b->step) : 0;
+    sub = sub < b->nsub ? sub : b->nsub - 1;
+    C = ref->PC + b->base + b->stride * row + b->offset * sub;
+    for (size_t k = 0; k < 3 * b->n; k++) {
+        sum += fabs(C[k]);
+    }
+    return (double)(b->n * b->n) * sum * 1e3 * 0x1p-52;
+}
+
+/* every ISA agrees with the scalar kernel within the documented bound */
+static void kernels(ephem_ctx *ref, const double *jd, size_t n)
+{
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    size_t isa = de440_set_isa(-1);
+    char what[64];
+
+    for (size_t i = 1; i <= isa; i++) {
+        size_t bad = 0;
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            de440_set_isa(ephem_isa_scalar);
+            de440_ephem_batch(ref, oid, jd, n, a);
+            de440_set_isa((int)i);
+            de440_ephem_batch(ref, oid, jd, n, b);
+            for (size_t k = 0; k < 3 * n; k++) {
+                bad += !same(a[k], b[k], ulps(ref, jd[k / 3], oid));
+            }
+        }
+        snprintf(what, sizeof(what), "isa %zu", i);
+        check(bad == 0, "kernels", what);
+    }
+    de440_set_isa(-1);
+    free(a);
+    free(b);
+}
+
+/*
+ * velocity and acceleration, per day, against central differences of
+ * position and velocity inside one sub-interval
+ */
+static void derivatives(ephem_ctx *ref, const double *jd, size_t n)
+{
+    const double h = 1e-4;
+    size_t bad = 0;
+
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        const ephem_body *b = &ref->body[oid];
+        double p[3][3], v[3][3], a[3][3], t[3];
+        double vmax = 0, amax = 0, dv = 0, da = 0;
+        for (size_t k = 0; k < n; k++) {
+            size_t row = de440_find_row(ref, jd[k]);
+            double u;
+            if (row == (size_t)-1) {
+                continue;
+            }
+            u = fmod(jd[k] - ref->PC[row * ref->cols], (double)b->step);
+            if (u < 2 * h || u > b->step - 2 * h) {
+                continue;
+            }
+            for (size_t i = 0; i < 3; i++) {
+                t[i] = jd[k] + h * ((double)i - 1);
+                de440_ephem_state(ref, t[i], oid, p[i], v[i], a[i]);
+            }
+            for (size_t c = 0; c < 3; c++) {
+                vmax = fmax(vmax, fabs(v[1][c]));
+                amax = fmax(amax, fabs(a[1][c]));
+                dv = fmax(dv, fabs((p[2][c] - p[0][c]) / (t[2] - t[0]) -
+                    v[1][c]));
+                da = fmax(da, fabs((v[2][c] - v[0][c]) / (t[2] - t[0]) -
+                    a[1][c]));
+            }
+        }
+        bad += !(dv <= 1e-6 * vmax && da <= 1e-6 * amax);
+    }
+    check(bad == 0, "derivatives", "finite differences");
+}
+
+/*
+ * a cursor agrees with single lookups for dates in any order, on a file
+ * and across the parts of a chain
+ */
+static void cursor(ephem_ctx *ref, ephem_ctx *ctx, const double *jd,
+    size_t n, const char *name)
+{
+    ephem_cursor cur;
+    double a[3], b[3];
+    size_t bad = 0;
+
+    de440_cursor_init(&cur, ctx);
+    for (size_t k = 0; k < n; k++) {
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            double tol = ulps(ref, jd[k], oid);
+            de440_ephem_obj(ref, jd[k], de440_find_row(ref, jd[k]), oid, a);
+            de440_cursor_obj(&cur, jd[k], oid, b);
+            for (size_t c = 0; c < 3; c++) {
+                bad += !same(a[c], b[c], tol);
+            }
+        }
+    }
+    check(bad == 0, "cursor", name);
+}
+
+/*
+ * all bodies at a date agree with single lookups, and bodies outside the
+ * mask are left as they were
+ */
+static void all(ephem_ctx *ref, ephem_ctx *ctx, const double *jd, size_t n,
+    const char *name)
+{
+    static const unsigned masks[] = {
+        ephem_mask_all, (1u << ephem_id_Moon) | (1u << ephem_id_Sun), 0x155
+    };
+    double out[ephem_id_Last][3], a[3];
+    size_t bad = 0;
+
+    for (size_t i = 0; i < sizeof(masks) / sizeof(masks[0]); i++) {
+        for (size_t k = 0; k < n; k++) {
+            for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+                out[oid][0] = out[oid][1] = out[oid][2] = -1;
+            }
+            de440_ephem_all(ctx, jd[k], masks[i], out);
+            for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+                double tol = ulps(ref, jd[k], oid);
+                if (!(masks[i] & (1u << oid))) {
+                    bad += out[oid][0] != -1 || out[oid][1] != -1 ||
+                        out[oid][2] != -1;
+                    continue;
+                }
+                de440_ephem_obj(ref, jd[k], de440_find_row(ref, jd[k]), oid,
+                    a);
+                for (size_t c = 0; c < 3; c++) {
+                    bad += !same(a[c], out[oid][c], tol);
+                }
+            }
+        }
+    }
+    check(bad == 0, "all bodies", name);
+}
+
+/*
+ * mixed queries come back in the order asked, each as its own batch of
+ * one date would give it, and NaN dates or dates off the file as NaN
+ */
+static void query(ephem_ctx *ctx, const double *jd, size_t n,
+    const char *name)
+{
+    double *qd = malloc(n * sizeof(double));
+    double *out = malloc(3 * n * sizeof(double)), a[3];
+    size_t *oid = malloc(n * sizeof(size_t)), bad = 0;
+    unsigned seed = 3;
+
+    for (size_t k = 0; k < n; k++) {
+        qd[k] = k % 97 == 0 ? NAN : jd[rand_r(&seed) % n];
+        oid[k] = rand_r(&seed) % ephem_id_Last;
+    }
+    de440_ephem_query(ctx, qd, oid, n, out);
+    for (size_t k = 0; k < n; k++) {
+        de440_ephem_batch(ctx, oid[k], qd + k, 1, a);
+        for (size_t c = 0; c < 3; c++) {
+            bad += !same(a[c], out[3 * k + c], 0);
+        }
+        if (isnan(qd[k]) || de440_find_row(ctx, qd[k]) == (size_t)-1) {
+            bad += !isnan(out[3 * k]) || !isnan(out[3 * k + 1]) ||
+                !isnan(out[3 * k + 2]);
+        }
+    }
+    check(bad == 0, "query", name);
+    free(qd);
+    free(out);
+    free(oid);
+}
+
+/*
+ * the DE440 ASCII header describes the built-in layout, and a legacy file
+ * given it evaluates as before
+ */
+static void jpl_header(ephem_ctx *ref, const char *src, const double *jd,
+    size_t n)
+{
+    const char *path = fixture("header.440");
+    FILE *f = fopen(path, "w");
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    size_t bad = 0;
+    ephem_ctx ctx;
+
+    if (!f) {
+        fprintf(stderr, "fopen: failed: %s\n", path);
+        exit(1);
+    }
+    fprintf(f, "KSIZE= %d    NCOEFF= %d\n\n", 2 * TEST_COLS, TEST_COLS);
+    fprintf(f, "GROUP   1010\n\nJPL Planetary Ephemeris DE440\n\n");
+    fprintf(f, "GROUP   1030\n\n  %.2f  %.2f         32.\n\n", TEST_START,
+        TEST_START + 32.0 * TEST_ROWS);
+    fprintf(f, "GROUP   1050\n\n"
+        "     3   171   231   309   342   366   387   405   423   441"
+        "   753   819   899\n"
+        "    14    10    13    11     8     7     6     6     6    13"
+        "    11    10    10\n"
+        "     4     2     2     1     1     1     1     1     1     8"
+        "     2     4     4\n\n");
+    fprintf(f, "GROUP   1070\n");
+    fclose(f);
+
+    de440_create_ephem(&ctx, src);
+    de440_jpl_layout(&ctx, path);
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        const ephem_body *p = &ref->body[oid], *q = &ctx.body[oid];
+        bad += p->base != q->base || p->stride != q->stride ||
+            p->n != q->n || p->step != q->step || p->nsub != q->nsub ||
+            p->offset != q->offset;
+        de440_ephem_batch(ref, oid, jd, n, a);
+        de440_ephem_batch(&ctx, oid, jd, n, b);
+        bad += memcmp(a, b, 3 * n * sizeof(double)) != 0;
+    }
+    check(bad == 0, "jpl header", "DE440 layout");
+    de440_destroy_ephem(&ctx);
+    free(a);
+    free(b);
+}
+
+/*
+ * writes the file's bodies as a DAF/SPK kernel of type 2 segments, split
+ * into ranges of records, with the Moon relative to the Earth or, as some
+ * kernels have it, the Moon and Earth relative to their barycenter
+ */
+static void spk_file(ephem_ctx *ref, const char *path, size_t ranges,
+    int geocentric)
+{
+    static const int32_t naif[ephem_id_Nutations] = {
+        10, 1, 2, 3, 4, 5, 6, 7, 8, 9, 301
+    };
+    const double emrat = 81.3005682214972154;
+    size_t cap = 2 * TEST_COLS * TEST_ROWS + 4 * 128, nd = 3 * 128, nsum = 0;
+    double *d = calloc(cap, sizeof(double));
+    char *rec = (char*)d;
+    int32_t v[3] = { 2, 6, 2 };
+    FILE *f;
+
+    for (size_t p = 0; p < ranges; p++) {
+        size_t r0 = TEST_ROWS * p / ranges, r1 = TEST_ROWS * (p + 1) / ranges;
+        double init = (ref->PC[r0 * ref->cols] - 2451545.0) * 86400;
+        for (size_t i = 0; i < ephem_id_Nutations + !geocentric; i++) {
+            size_t oid = i < ephem_id_Nutations ? i : ephem_id_Moon;
+            const ephem_body *b = &ref->body[oid];
+            double step = b->step * 86400.0, scale = 1;
+            double *sm = d + 128 + 3 + 5 * nsum++;
+            int32_t ints[6] = { naif[oid], 0, 1, 2, (int32_t)nd + 1, 0 };
+            if (oid == ephem_id_Moon) {
+                ints[1] = geocentric ? 399 : 3;
+                scale = geocentric ? 1 : emrat / (1 + emrat);
+            }
+            if (i == ephem_id_Nutations) {
+                ints[0] = 399;
+                scale = -1 / (1 + emrat);
+            }
+            for (size_t r = r0; r < r1; r++) {
+                for (size_t sub = 0; sub < b->nsub; sub++) {
+                    const double *C = ref->PC + b->base + b->stride * r +
+                        b->offset * sub;
+                    d[nd++] = init + ((r - r0) * b->nsub + sub + 0.5) * step;
+                    d[nd++] = step / 2;
+                    for (size_t k = 0; k < 3 * b->n; k++) {
+                        d[nd++] = C[k] * scale;
+                    }
+                }
+            }
+            d[nd++] = init;
+            d[nd++] = step;
+            d[nd++] = (double)(2 + 3 * b->n);
+            d[nd++] = (double)((r1 - r0) * b->nsub);
+            ints[5] = (int32_t)nd;
+            sm[0] = init;
+            sm[1] = init + (r1 - r0) * 32 * 86400.0;
+            memcpy(sm + 2, ints, sizeof(ints));
+        }
+    }
+    d[128 + 2] = (double)nsum;
+    memcpy(rec, "DAF/SPK ", 8);
+    memcpy(rec + 8, v, 2 * sizeof(int32_t));
+    memcpy(rec + 76, v + 2, sizeof(int32_t));
+    memcpy(rec + 80, v + 2, sizeof(int32_t));
+    memcpy(rec + 88, "LTL-IEEE", 8);
+
+    f = fopen(path, "w");
+    if (!f || fwrite(d, sizeof(double), (nd + 127) / 128 * 128, f) !=
+            (nd + 127) / 128 * 128) {
+        fprintf(stderr, "fwrite: failed: %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+    free(d);
+}
+
+/*
+ * kernels in one range or several, with the geocentric Moon given or
+ * derived, evaluate as the file they were written from. nutations and
+ * librations are not in SPK kernels and come back as NaN.
+ */
+static void spk(ephem_ctx *ref, const double *jd, size_t n)
+{
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    const char *name[] = { "one.bsp", "ranges.bsp" };
+    const char *path[] = { fixture(name[0]), fixture(name[1]) };
+    ephem_ctx ctx;
+
+    spk_file(ref, path[0], 1, 1);
+    spk_file(ref, path[1], 2, 0);
+    for (size_t i = 0; i < 2; i++) {
+        size_t bad = 0;
+        de440_spk_ephem(&ctx, path[i], 0);
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            de440_ephem_batch(ref, oid, jd, n, a);
+            de440_ephem_batch(&ctx, oid, jd, n, b);
+            for (size_t k = 0; k < 3 * n; k++) {
+                if (oid >= ephem_id_Nutations) {
+                    bad += !isnan(b[k]);
+                } else {
+                    bad += !same(a[k], b[k], ulps(ref, jd[k / 3], oid));
+                }
+            }
+        }
+        check(bad == 0, "spk", name[i]);
+        de440_destroy_ephem(&ctx);
+    }
+    free(a);
+    free(b);
+}
+
+/* runs a tool given on the command line, true when it exits with 0 */
+static int run(const char *fmt, ...)
+{
+    char cmd[4096];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(cmd, sizeof(cmd), fmt, ap);
+    va_end(ap);
+    return system(cmd) == 0;
+}
+
+/*
+ * writes records r0 to r1 as JPL ASCII: a record number and coefficient
+ * count, then the coefficients three to a line in Fortran D notation with
+ * the last line padded
+ */
+static void ascii_file(ephem_ctx *ref, const char *path, size_t r0,
+    size_t r1)
+{
+    FILE *f = fopen(path, "w");
+    char num[32], *e;
+
+    if (!f) {
+        fprintf(stderr, "fopen: failed: %s\n", path);
+        exit(1);
+    }
+    for (size_t r = r0; r < r1; r++) {
+        const double *R = ref->PC + r * ref->cols;
+        fprintf(f, "%6zu%6zu\n", r + 1, ref->cols);
+        for (size_t k = 0; k < (ref->cols + 2) / 3 * 3; k++) {
+            snprintf(num, sizeof(num), "%.17E", k < ref->cols ? R[k] : 0.0);
+            if ((e = strchr(num, 'E'))) {
+                *e = 'D';
+            }
+            fprintf(f, " %s%s", num, k % 3 == 2 ? "\n" : "");
+        }
+    }
+    fclose(f);
+}
+
+/*
+ * convert reads two ASCII files given out of order and overlapping by a
+ * record, written legacy and body-major, and the coefficients are exact
+ */
+static void ascii(ephem_ctx *ref, const char *convert, const double *jd,
+    size_t n)
+{
+    const char *src[] = { fixture("ascp-1.440"), fixture("ascp-2.440") };
+    const char *name[] = { "ascii-legacy.bin", "ascii-body.bin" };
+    const char *opt[] = { "-l", "-b" };
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    ephem_ctx ctx;
+
+    ascii_file(ref, src[0], 0, TEST_ROWS / 2 + 1);
+    ascii_file(ref, src[1], TEST_ROWS / 2, TEST_ROWS);
+    for (size_t i = 0; i < 2; i++) {
+        const char *path = fixture(name[i]);
+        size_t bad = 0;
+        if (!run("'%s' %s -j 2 '%s' '%s' '%s'", convert, opt[i], src[1],
+                src[0], path)) {
+            check(0, "convert ascii", name[i]);
+            continue;
+        }
+        de440_create_ephem(&ctx, path);
+        bad += ctx.rows != TEST_ROWS;
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            de440_ephem_batch(ref, oid, jd, n, a);
+            de440_ephem_batch(&ctx, oid, jd, n, b);
+            bad += memcmp(a, b, 3 * n * sizeof(double)) != 0;
+        }
+        check(bad == 0, "convert ascii", name[i]);
+        de440_destroy_ephem(&ctx);
+    }
+    free(a);
+    free(b);
+}
+
+/*
+ * a slice of the file keeps the records from s to e, its bodies in mask
+ * evaluating within their stored error and the rest as NaN
+ */
+static void slice(ephem_ctx *ref, ephem_ctx *ctx, const double *jd,
+    size_t n, double s, double e, unsigned mask, const char *name)
+{
+    double *in = malloc(n * sizeof(double));
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    size_t m = 0, bad = 0;
+
+    for (size_t k = 0; k < n; k++) {
+        if (jd[k] >= s && jd[k] < e) {
+            in[m++] = jd[k];
+        }
+    }
+    bad += ctx->jd_start != s || ctx->rows != (size_t)((e - s) / 32);
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        double tol = ctx->body[oid].err;
+        de440_ephem_batch(ref, oid, in, m, a);
+        de440_ephem_batch(ctx, oid, in, m, b);
+        for (size_t k = 0; k < 3 * m; k++) {
+            if (mask & (1u << oid)) {
+                bad += !same(a[k], b[k], tol + 1e-12 * fabs(a[k]));
+            } else {
+                bad += !isnan(b[k]);
+            }
+        }
+    }
+    check(m > 0 && bad == 0, "slice", name);
+    free(in);
+    free(a);
+    free(b);
+}
+
+/*
+ * embed writes a packed slice as a header, and the words parsed back out
+ * of it load with de440_create_embedded
+ */
+static void embedded(ephem_ctx *ref, const char *src, const char *embed,
+    const double *jd, size_t n)
+{
+    const char *path = fixture("embedded.h");
+    double s = TEST_START + 32.0 * 8, e = TEST_START + 32.0 * 24;
+    unsigned mask = 0x555, shown = 0;
+    size_t size = 0, nw = 0, len;
+    uint64_t *w = NULL;
+    char *text, *p;
+    ephem_ctx ctx;
+    FILE *f;
+
+    if (!run("'%s' -s %.1f -e %.1f -m 0x%x -f packed -n test_embedded "
+            "'%s' '%s' >/dev/null", embed, s, e, mask, src, path) ||
+            !(f = fopen(path, "r"))) {
+        check(0, "embed", path);
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = calloc(len + 1, 1);
+    if (!text || fread(text, 1, len, f) != len) {
+        fprintf(stderr, "fread: failed: %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+
+    p = strstr(text, "mask ");
+    if (p && sscanf(p, "mask 0x%x, %zu bytes", &shown, &size) == 2 &&
+            (p = strstr(text, "test_embedded[")) && (p = strchr(p, '{'))) {
+        w = aligned_alloc(64, (size + 63) / 64 * 64);
+        for (p++; w && nw < (size + 7) / 8; p++) {
+            char *end;
+            w[nw] = strtoull(p, &end, 16);
+            if (end == p) {
+                break;
+            }
+            nw++;
+            p = end;
+        }
+    }
+    if (!w || shown != mask || nw != (size + 7) / 8 || !strchr(p, '}')) {
+        check(0, "embed", "header");
+    } else {
+        de440_create_embedded(&ctx, w, size);
+        slice(ref, &ctx, jd, n, s, e, mask, "embed");
+        de440_destroy_ephem(&ctx);
+    }
+    free(w);
+    free(text);
+}
+
+/*
+ * extract keeps a window given as a calendar date and a julian one, and
+ * bodies given by name and id, written body-major in f32
+ */
+static void extracted(ephem_ctx *ref, const char *src, const char *extract,
+    const double *jd, size_t n)
+{
+    const char *path = fixture("extract.bin");
+    double s = TEST_START + 32.0 * 4, e = TEST_START + 32.0 * 20;
+    unsigned mask = 1u << ephem_id_Sun | 1u << ephem_id_Mars |
+        1u << ephem_id_Moon;
+    ephem_ctx ctx;
+
+    if (!run("'%s' -s 2000-04-30 -e %.1f -o sun,MOON,%d -b -f f32 '%s' "
+            "'%s' >/dev/null", extract, e, ephem_id_Mars, src, path)) {
+        check(0, "extract", path);
+        return;
+    }
+    de440_map_ephem(&ctx, path, 0);
+    slice(ref, &ctx, jd, n, s, e, mask, "extract");
+    de440_destroy_ephem(&ctx);
+}
+
+/*
+ * boundary dates find the later record, by the direct lookup of regular
+ * records and the search of irregular ones, and batches agree with it
+ */
+static void boundaries(ephem_ctx *ref)
+{
+    double *PC = calloc(8 * TEST_COLS, sizeof(double));
+    double jd[TEST_ROWS + 1], a[3 * (TEST_ROWS + 1)], b[3];
+    size_t bad = 0;
+    ephem_ctx ctx;
+
+    for (size_t r = 0; r <= TEST_ROWS; r++) {
+        jd[r] = TEST_START + 32.0 * r;
+        bad += de440_find_row(ref, jd[r]) != (r < TEST_ROWS ? r : r - 1);
+    }
+    bad += de440_find_row(ref, TEST_START - 1e-6) != (size_t)-1;
+    bad += de440_find_row(ref, jd[TEST_ROWS] + 1e-6) != (size_t)-1;
+    /* kernels round differently, against the body's largest value */
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        double tol = 0;
+        de440_ephem_batch(ref, oid, jd, TEST_ROWS + 1, a);
+        for (size_t k = 0; k < 3 * (TEST_ROWS + 1); k++) {
+            tol = fabs(a[k]) > tol ? fabs(a[k]) : tol;
+        }
+        for (size_t r = 0; r <= TEST_ROWS; r++) {
+            de440_ephem_obj(ref, jd[r], de440_find_row(ref, jd[r]), oid, b);
+            for (size_t c = 0; c < 3; c++) {
+                bad += !same(a[3 * r + c], b[c], 1e-12 * tol);
+            }
+        }
+    }
+    check(bad == 0, "boundaries", "regular");
+
+    /* records of 16 and 48 days in turn */
+    bad = 0;
+    for (size_t r = 0; r < 8; r++) {
+        PC[r * TEST_COLS] = r == 0 ? TEST_START :
+            PC[(r - 1) * TEST_COLS + 1];
+        PC[r * TEST_COLS + 1] = PC[r * TEST_COLS] + (r % 2 ? 48 : 16);
+    }
+    de440_init_ephem(&ctx, 8, TEST_COLS, PC);
+    for (size_t r = 0; r < 8; r++) {
+        bad += de440_find_row(&ctx, PC[r * TEST_COLS]) != r;
+        bad += de440_find_row(&ctx, PC[r * TEST_COLS + 1]) !=
+            (r < 7 ? r + 1 : r);
+    }
+    check(bad == 0, "boundaries", "irregular");
+    de440_destroy_ephem(&ctx);
+}
+
+/* every body of ctx against the reference, within the stored error */
+static void compare(ephem_ctx *ref, ephem_ctx *ctx, const double *jd,
+    size_t n, const char *name)
+{
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    size_t bad = 0;
+
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        double tol = ctx->body[oid].err;
+        de440_ephem_batch(ref, oid, jd, n, a);
+        de440_ephem_batch(ctx, oid, jd, n, b);
+        for (size_t k = 0; k < 3 * n; k++) {
+            bad += !same(a[k], b[k], tol + 1e-12 * fabs(a[k]));
+        }
+    }
+    check(bad == 0, "round trip", name);
+    free(a);
+    free(b);
+}
+
+static void round_trip(ephem_ctx *ref, const char *src, const double *jd,
+    size_t n)
+{
+    static const struct {
+        const char *name;
+        int layout;
+        int format;
+    } files[] = {
+        { "f64-row.bin", ephem_layout_row, ephem_format_f64 },
+        { "f64-body.bin", ephem_layout_body, ephem_format_f64 },
+        { "f32-row.bin", ephem_layout_row, ephem_format_f32 },
+        { "f32-body.bin", ephem_layout_body, ephem_format_f32 },
+        { "packed.bin", ephem_layout_row, ephem_format_packed },
+    };
+    ephem_save_opts opts = { 0 };
+    ephem_ctx ctx;
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+        opts.layout = files[i].layout;
+        opts.format = files[i].format;
+        opts.block_rows = 4;
+        const char *path = fixture(files[i].name);
+        de440_save_ephem(ref, path, &opts);
+
+        de440_create_ephem(&ctx, path);
+        compare(ref, &ctx, jd, n, files[i].name);
+        de440_destroy_ephem(&ctx);
+        de440_map_ephem(&ctx, path, 0);
+        compare(ref, &ctx, jd, n, files[i].name);
+        de440_destroy_ephem(&ctx);
+        de440_page_ephem(&ctx, path, 4, 1 << 18);
+        compare(ref, &ctx, jd, n, files[i].name);
+        de440_destroy_ephem(&ctx);
+    }
+    de440_page_ephem(&ctx, src, 4, 1 << 18);
+    compare(ref, &ctx, jd, n, "test.bin");
+    de440_destroy_ephem(&ctx);
+}
+
+/* three files meeting on record boundaries, the middle one packed */
+static void chain(ephem_ctx *ref, const double *jd, size_t n)
+{
+    const char *parts[] = {
+        fixture("chain-1.bin"), fixture("chain-2.bin"), fixture("chain-3.bin")
+    };
+    ephem_save_opts opts = { 0 };
+    ephem_ctx ctx;
+
+    for (size_t p = 0; p < 3; p++) {
+        opts.format = p == 1 ? ephem_format_packed : ephem_format_f64;
+        opts.jd_start = p == 0 ? 0 : TEST_START + 32.0 * 16 * p;
+        opts.jd_end = p == 2 ? 0 : TEST_START + 32.0 * 16 * (p + 1);
+        de440_save_ephem(ref, parts[p], &opts);
+    }
+    de440_chain_ephem(&ctx, parts, 3, 0);
+    compare(ref, &ctx, jd, n, "chain");
+    de440_destroy_ephem(&ctx);
+}
+
+/* parallel batches are bitwise the serial batch for any thread count */
+static void parallel(ephem_ctx *ctx, const double *jd, size_t n,
+    const char *name)
+{
+    static const size_t threads[] = { 2, 3, TEST_THREADS, 0 };
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    size_t bad = 0;
+
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        de440_ephem_batch(ctx, oid, jd, n, a);
+        for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+            de440_ephem_batch_parallel(ctx, oid, jd, n, b, threads[i]);
+            for (size_t k = 0; k < 3 * n; k++) {
+                bad += !(a[k] == b[k] || (isnan(a[k]) && isnan(b[k])));
+            }
+        }
+    }
+    check(bad == 0, "parallel", name);
+    free(a);
+    free(b);
+}
+
+/*
+ * dates crowded into one sub-interval are split over the workers and,
+ * with every ISA, give a date the same result as evaluating it alone
+ */
+static void dense(ephem_ctx *ctx, const char *name)
+{
+    size_t n = 10 * 1024 + 3, isa = de440_set_isa(-1), bad = 0;
+    double *jd = malloc(n * sizeof(double)), *a = malloc(3 * n *
+        sizeof(double)), b[3];
+    char what[64];
+
+    for (size_t k = 0; k < n; k++) {
+        jd[k] = TEST_START + 32.0 * 5 + 2.0 * k / n;
+    }
+    for (size_t i = 0; i <= isa; i++) {
+        de440_set_isa((int)i);
+        snprintf(what, sizeof(what), "%s dense isa %zu", name, i);
+        parallel(ctx, jd, n, what);
+        for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+            de440_ephem_batch(ctx, oid, jd, n, a);
+            for (size_t k = 0; k < n; k += 7) {
+                de440_ephem_batch(ctx, oid, jd + k, 1, b);
+                bad += memcmp(a + 3 * k, b, sizeof(b)) != 0;
+            }
+        }
+        check(bad == 0, "single dates", what);
+    }
+    de440_set_isa(-1);
+    free(jd);
+    free(a);
+}
+
+typedef struct {
+    ephem_ctx *ref;
+    ephem_ctx *ctx;
+    const double *jd;
+    size_t n;
+    size_t calls;
+    size_t bad;
+} obj_arg;
+
+static void* obj_thread(void *p)
+{
+    obj_arg *arg = p;
+    double a[3], b[3];
+    size_t row;
+
+    for (size_t k = 0; k < arg->n; k++) {
+        double jd = arg->jd[(k * 7) % 97];
+        size_t oid = k % ephem_id_Last;
+        row = de440_find_row(arg->ref, jd);
+        if (row == -1) {
+            continue;
+        }
+        de440_ephem_obj(arg->ref, jd, row, oid, a);
+        de440_ephem_obj(arg->ctx, jd, row, oid, b);
+        arg->bad += memcmp(a, b, sizeof(a)) != 0;
+        arg->calls++;
+    }
+    return NULL;
+}
+
+/* single dates from several threads at once, bitwise the reference */
+static size_t concurrent(ephem_ctx *ref, ephem_ctx *ctx, const double *jd,
+    size_t n, size_t *calls)
+{
+    obj_arg arg[TEST_THREADS];
+    pthread_t thread[TEST_THREADS];
+    size_t bad = 0;
+
+    *calls = 0;
+    for (size_t t = 0; t < TEST_THREADS; t++) {
+        arg[t] = (obj_arg){ ref, ctx, jd + t, n, 0, 0 };
+        if (pthread_create(&thread[t], NULL, obj_thread, &arg[t])) {
+            fprintf(stderr, "pthread_create: failed\n");
+            exit(1);
+        }
+    }
+    for (size_t t = 0; t < TEST_THREADS; t++) {
+        pthread_join(thread[t], NULL);
+        *calls += arg[t].calls;
+        bad += arg[t].bad;
+    }
+    return bad;
+}
+
+static double distance(const double *a, const double *b)
+{
+    return sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) +
+        (a[2] - b[2]) * (a[2] - b[2]));
+}
+
+typedef struct {
+    ephem_ctx *ref;
+    ephem_ctx *ctx;
+    const double *jd;
+    size_t n;
+    size_t cut;
+    size_t bad;
+} tol_arg;
+
+static void* tol_thread(void *p)
+{
+    tol_arg *arg = p;
+    double a[3], b[3], bound;
+    size_t row;
+
+    for (size_t k = 0; k < arg->n; k++) {
+        double jd = arg->jd[k], tol = pow(10.0, (double)(k % 6));
+        size_t oid = k % ephem_id_Nutations;
+        row = de440_find_row(arg->ref, jd);
+        if (row == -1) {
+            continue;
+        }
+        de440_ephem_obj(arg->ref, jd, row, oid, a);
+        bound = de440_ephem_obj_tol(arg->ctx, jd, row, oid, tol, b);
+        arg->bad += !(distance(a, b) <= bound + 1e-12 * fabs(a[0]) +
+            1e-12 * fabs(a[1]) + 1e-12 * fabs(a[2]));
+        arg->cut += memcmp(a, b, sizeof(a)) != 0;
+    }
+    return NULL;
+}
+
+/*
+ * truncated results are within the bound returned, for single dates whose
+ * tail bounds are built by whichever thread gets there first and batches
+ */
+static void tolerance(ephem_ctx *ref, const char *src, const double *jd,
+    size_t n)
+{
+    tol_arg arg[TEST_THREADS];
+    pthread_t thread[TEST_THREADS];
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    size_t bad = 0, cut = 0;
+    ephem_ctx ctx;
+
+    de440_map_ephem(&ctx, src, 0);
+    for (size_t t = 0; t < TEST_THREADS; t++) {
+        arg[t] = (tol_arg){ ref, &ctx, jd + t, n - TEST_THREADS, 0, 0 };
+        if (pthread_create(&thread[t], NULL, tol_thread, &arg[t])) {
+            fprintf(stderr, "pthread_create: failed\n");
+            exit(1);
+        }
+    }
+    for (size_t t = 0; t < TEST_THREADS; t++) {
+        pthread_join(thread[t], NULL);
+        bad += arg[t].bad;
+        cut += arg[t].cut;
+    }
+    check(bad == 0 && cut > 0, "tolerance", "single dates");
+
+    bad = cut = 0;
+    for (size_t oid = 0; oid < ephem_id_Last; oid++) {
+        for (double tol = 1; tol <= 1e5; tol *= 10) {
+            double bound = de440_ephem_batch_tol(&ctx, oid, jd, n, tol, b);
+            de440_ephem_batch(ref, oid, jd, n, a);
+            for (size_t k = 0; k < n; k++) {
+                double *p = a + 3 * k, *q = b + 3 * k;
+                if (oid >= ephem_id_Nutations) {
+                    bad += memcmp(p, q, 3 * sizeof(double)) != 0 &&
+                        !isnan(p[0]);
+                } else if (!isnan(p[0])) {
+                    bad += !(distance(p, q) <= bound + 1e-12 *
+                        (fabs(p[0]) + fabs(p[1]) + fabs(p[2])));
+                    cut += memcmp(p, q, 3 * sizeof(double)) != 0;
+                }
+            }
+        }
+    }
+    check(bad == 0 && cut > 0, "tolerance", "batch");
+    de440_destroy_ephem(&ctx);
+    free(a);
+    free(b);
+}
+
+/*
+ * float32 batches are within the bound returned. ISAs without the float32
+ * kernels give the double batch and its bound, with no rounding added.
+ */
+static void single(ephem_ctx *ref, const double *jd, size_t n)
+{
+    double *a = malloc(3 * n * sizeof(double));
+    double *b = malloc(3 * n * sizeof(double));
+    size_t isa = de440_set_isa(-1);
+    char what[64];
+
+    for (size_t i = 0; i <= isa; i++) {
+        size_t bad = 0;
+        de440_set_isa((int)i);
+        for (size_t oid = 0; oid < ephem_id_Nutations; oid++) {
+            double bound = de440_ephem_batch_f32(ref, oid, jd, n, 0, b);
+            de440_ephem_batch(ref, oid, jd, n, a);
+            if (i < ephem_isa_avx2) {
+                bad += bound != ref->body[oid].err;
+                bad += memcmp(a, b, 3 * n * sizeof(double)) != 0;
+                continue;
+            }
+            bad += !(bound > ref->body[oid].err);
+            for (size_t k = 0; k < n; k++) {
+                bad += !isnan(a[3 * k]) && !(distance(a + 3 * k, b + 3 * k) <=
+                    bound);
+            }
+        }
+        snprintf(what, sizeof(what), "isa %zu", i);
+        check(bad == 0, "float32", what);
+    }
+    de440_set_isa(-1);
+    free(a);
+    free(b);
+}
+
+/* packed contexts decode through one page cache shared by all threads */
+static void shared_pages(ephem_ctx *ref, const double *jd)
+{
+    const char *path = fixture("packed.bin");
+    size_t calls;
+    ephem_ctx ctx;
+
+    de440_create_ephem(&ctx, path);
+    check(concurrent(ref, &ctx, jd, 20000, &calls) == 0, "threads",
+        "packed create");
+    de440_destroy_ephem(&ctx);
+    de440_map_ephem(&ctx, path, 0);
+    check(concurrent(ref, &ctx, jd, 20000, &calls) == 0, "threads",
+        "packed map");
+    de440_destroy_ephem(&ctx);
+    de440_page_ephem(&ctx, path, 1, 1 << 12);
+    check(concurrent(ref, &ctx, jd, 20000, &calls) == 0, "threads",
+        "packed page");
+    de440_destroy_ephem(&ctx);
+}
+
+/*
+ * cached results are the uncached ones, and every lookup is counted, on
+ * a mapped file and on a packed one whose misses share its page cache.
+ */
+static void cache(ephem_ctx *ref, const char *src, const double *jd)
+{
+    const char *path[] = { src, fixture("packed.bin") };
+    size_t hits, misses, calls, bad;
+    ephem_ctx ctx;
+
+    for (size_t i = 0; i < 2; i++) {
+        de440_map_ephem(&ctx, path[i], 0);
+        de440_cache_init(&ctx, 1024);
+        bad = concurrent(ref, &ctx, jd, 40000, &calls);
+        de440_cache_stats(&ctx, &hits, &misses);
+        check(bad == 0, "cache results", path[i]);
+        check(hits > 0 && hits + misses == calls, "cache counts", path[i]);
+        de440_destroy_ephem(&ctx);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *src = fixture("test.bin");
+    const char *parts[] = {
+        fixture("chain-1.bin"), fixture("chain-2.bin"), fixture("chain-3.bin")
+    };
+    double *jd = malloc(TEST_DATES * sizeof(double));
+    ephem_ctx ref, ctx;
+
+    dates(jd, TEST_DATES);
+    generate(src);
+    de440_create_ephem(&ref, src);
+
+    kernels(&ref, jd, TEST_DATES);
+    derivatives(&ref, jd, TEST_DATES);
+    cursor(&ref, &ref, jd, TEST_DATES, "file");
+    all(&ref, &ref, jd, TEST_DATES, "file");
+    query(&ref, jd, TEST_DATES, "file");
+    boundaries(&ref);
+    jpl_header(&ref, src, jd, TEST_DATES);
+    spk(&ref, jd, TEST_DATES);
+    if (argc > 1) {
+        ascii(&ref, argv[1], jd, TEST_DATES);
+    }
+    if (argc > 2) {
+        embedded(&ref, src, argv[2], jd, TEST_DATES);
+    }
+    if (argc > 3) {
+        extracted(&ref, src, argv[3], jd, TEST_DATES);
+    }
+    round_trip(&ref, src, jd, TEST_DATES);
+    chain(&ref, jd, TEST_DATES);
+
+    de440_map_ephem(&ctx, src, 0);
+    parallel(&ctx, jd, TEST_DATES, "map");
+    dense(&ctx, "map");
+    de440_destroy_ephem(&ctx);
+    de440_page_ephem(&ctx, fixture("packed.bin"), 4, 1 << 18);
+    cursor(&ref, &ctx, jd, TEST_DATES, "packed");
+    all(&ref, &ctx, jd, TEST_DATES, "packed");
+    query(&ctx, jd, TEST_DATES, "packed");
+    parallel(&ctx, jd, TEST_DATES, "packed");
+    dense(&ctx, "packed");
+    de440_destroy_ephem(&ctx);
+    de440_chain_ephem(&ctx, parts, 3, 0);
+    cursor(&ref, &ctx, jd, TEST_DATES, "chain");
+    all(&ref, &ctx, jd, TEST_DATES, "chain");
+    query(&ctx, jd, TEST_DATES, "chain");
+    parallel(&ctx, jd, TEST_DATES, "chain");
+    de440_destroy_ephem(&ctx);
+
+    tolerance(&ref, src, jd, TEST_DATES);
+    single(&ref, jd, TEST_DATES);
+    shared_pages(&ref, jd);
+    cache(&ref, src, jd);
+
+    de440_destroy_ephem(&ref);
+    free(jd);
+    printf("test_ephembra: %zu failures\n", failures);
+    return failures != 0;
+}